@@ -0,0 +1,132 @@
+// $Id: arena.cpp,v 1.1 2015-01-14 16:45:02-08 - - $
+
+#include <algorithm>
+#include <iostream>
+#include <malloc.h>
+
+using namespace std;
+
+#include "arena.h"
+#include "debug.h"
+
+slab_arena::~slab_arena() {
+   for (char* chunk: chunks) ::operator delete (chunk);
+}
+
+void* slab_arena::carve (size_t bytes) {
+   if (cursor + bytes > limit) {
+      // What is left at the end of the old chunk is never used.
+      if (not chunks.empty()) carved.back() = cursor - chunks.back();
+      cursor = static_cast<char*> (::operator new (CHUNK_SIZE));
+      limit = cursor + CHUNK_SIZE;
+      chunks.push_back (cursor);
+      carved.push_back (0);
+      reserved += CHUNK_SIZE;
+      DEBUGF ('a', "chunk " << chunks.size() << " at "
+             << static_cast<void*> (cursor));
+   }
+   void* block = cursor;
+   cursor += bytes;
+   return block;
+}
+
+void* slab_arena::allocate (size_t bytes) {
+   lock_guard<mutex> guard (lock);
+   if (bytes == 0) bytes = 1;
+   if (bytes > LARGEST) {
+      in_use += bytes;
+      reserved += bytes;
+      return ::operator new (bytes);
+   }
+   size_t sclass = size_class (bytes);
+   in_use += sclass * GRAIN;
+   free_block*& head = free_lists[sclass - 1];
+   if (head == nullptr or fresh) return carve (sclass * GRAIN);
+   free_block* block = head;
+   head = block->next;
+   return block;
+}
+
+void slab_arena::deallocate (void* block, size_t bytes) {
+   lock_guard<mutex> guard (lock);
+   if (bytes == 0) bytes = 1;
+   if (bytes > LARGEST) {
+      in_use -= bytes;
+      reserved -= bytes;
+      ::operator delete (block);
+      return;
+   }
+   size_t sclass = size_class (bytes);
+   in_use -= sclass * GRAIN;
+   free_block* freed = static_cast<free_block*> (block);
+   freed->next = free_lists[sclass - 1];
+   free_lists[sclass - 1] = freed;
+}
+
+void slab_arena::set_fresh (bool is_fresh) {
+   lock_guard<mutex> guard (lock);
+   fresh = is_fresh;
+}
+
+size_t slab_arena::release_empty() {
+   lock_guard<mutex> guard (lock);
+   if (chunks.size() < 2) return 0;
+   carved.back() = cursor - chunks.back();
+   // Add up the free bytes in each chunk, finding the chunk a block
+   // is in by address.
+   vector<size_t> order (chunks.size());
+   for (size_t index = 0; index < order.size(); ++index) {
+      order[index] = index;
+   }
+   sort (order.begin(), order.end(), [this] (size_t one, size_t two) {
+      return chunks[one] < chunks[two];
+   });
+   auto chunk_of = [this, &order] (const void* block) {
+      auto after = upper_bound (order.begin(), order.end(), block,
+                   [this] (const void* address, size_t index) {
+                      return address < chunks[index];
+                   });
+      return *(after - 1);
+   };
+   vector<size_t> free_bytes (chunks.size());
+   for (size_t sclass = 1; sclass <= LARGEST / GRAIN; ++sclass) {
+      for (free_block* block = free_lists[sclass - 1];
+           block != nullptr; block = block->next) {
+         free_bytes[chunk_of (block)] += sclass * GRAIN;
+      }
+   }
+   // The chunk being carved from is kept.
+   vector<bool> empty (chunks.size());
+   for (size_t index = 0; index + 1 < chunks.size(); ++index) {
+      empty[index] = free_bytes[index] == carved[index];
+   }
+   for (size_t sclass = 1; sclass <= LARGEST / GRAIN; ++sclass) {
+      free_block** link = &free_lists[sclass - 1];
+      while (*link != nullptr) {
+         if (empty[chunk_of (*link)]) *link = (*link)->next;
+                                 else link = &(*link)->next;
+      }
+   }
+   size_t kept = 0;
+   size_t released = 0;
+   for (size_t index = 0; index < chunks.size(); ++index) {
+      if (empty[index]) {
+         ::operator delete (chunks[index]);
+         released += CHUNK_SIZE;
+         continue;
+      }
+      chunks[kept] = chunks[index];
+      carved[kept] = carved[index];
+      ++kept;
+   }
+   chunks.resize (kept);
+   carved.resize (kept);
+   reserved -= released;
+   // The chunks came from the heap, which keeps pages freed below
+   // its top unless asked to give them back.
+   if (released > 0) malloc_trim (0);
+   DEBUGF ('a', "released " << released << " bytes, "
+          << kept << " chunks kept");
+   return released;
+}
+
@@ -0,0 +1,112 @@
+// $Id: arena.h,v 1.1 2015-01-14 16:45:02-08 - - $
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+using namespace std;
+
+//
+// class slab_arena -
+//    A slab allocator for the many small objects that make up the
+//    tree:  inodes, their directory and file payloads, dirents and
+//    words.  Memory is carved out of large chunks, and freed blocks
+//    are kept on one free list per size class, so creating or
+//    removing a node never goes to the system allocator.  Requests
+//    larger than the largest size class are passed through.  A
+//    lock is held around each call, since a lazily loaded directory
+//    may be filled in by an lsr worker thread, and sessions share
+//    the tree.  The byte counts may be read without it.
+// allocate, deallocate -
+//    The size given to deallocate must match the one allocated.
+// set_fresh -
+//    While fresh, blocks are only carved from new chunks and never
+//    taken from the free lists, so that what is allocated is laid
+//    out in one run in the order it is allocated.
+// release_empty -
+//    Gives back to the system every chunk none of whose blocks are
+//    in use, taking its blocks off the free lists, and returns the
+//    number of bytes given back.  Takes time in proportion to the
+//    number of free blocks.
+// bytes_in_use -
+//    Bytes currently handed out, rounded up to the size classes.
+// bytes_reserved -
+//    Bytes obtained from the system for chunks and large blocks.
+//
+
+class slab_arena {
+   private:
+      static constexpr size_t GRAIN {16};
+      static constexpr size_t LARGEST {512};
+      static constexpr size_t CHUNK_SIZE {256 * 1024};
+      struct free_block { free_block* next; };
+      free_block* free_lists[LARGEST / GRAIN] {};
+      vector<char*> chunks;
+      vector<size_t> carved;
+      char* cursor {nullptr};
+      char* limit {nullptr};
+      atomic<size_t> in_use {0};
+      atomic<size_t> reserved {0};
+      bool fresh {false};
+      mutex lock;
+      static size_t size_class (size_t bytes) {
+         return (bytes + GRAIN - 1) / GRAIN;
+      }
+      void* carve (size_t bytes);
+   public:
+      slab_arena() = default;
+      slab_arena (const slab_arena&) = delete;
+      slab_arena& operator= (const slab_arena&) = delete;
+      ~slab_arena();
+      void* allocate (size_t bytes);
+      void deallocate (void* block, size_t bytes);
+      void set_fresh (bool is_fresh);
+      size_t release_empty();
+      size_t bytes_in_use() const { return in_use; }
+      size_t bytes_reserved() const { return reserved; }
+};
+
+//
+// arena_allocator -
+//    Standard allocator which draws from a slab_arena, so that
+//    allocate_shared and the standard containers can be placed in
+//    the arena.
+//
+
+template <typename item_t>
+struct arena_allocator {
+   using value_type = item_t;
+   slab_arena* arena;
+   arena_allocator (slab_arena* arena): arena (arena) {}
+   template <typename other_t>
+   arena_allocator (const arena_allocator<other_t>& that):
+                    arena (that.arena) {}
+   template <typename other_t>
+   struct rebind { using other = arena_allocator<other_t>; };
+   item_t* allocate (size_t count) {
+      return static_cast<item_t*> (
+             arena->allocate (count * sizeof (item_t)));
+   }
+   void deallocate (item_t* block, size_t count) {
+      arena->deallocate (block, count * sizeof (item_t));
+   }
+};
+
+template <typename left_t, typename right_t>
+bool operator== (const arena_allocator<left_t>& left,
+                 const arena_allocator<right_t>& right) {
+   return left.arena == right.arena;
+}
+
+template <typename left_t, typename right_t>
+bool operator!= (const arena_allocator<left_t>& left,
+                 const arena_allocator<right_t>& right) {
+   return left.arena != right.arena;
+}
+
+#endif
+
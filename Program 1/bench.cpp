@@ -0,0 +1,307 @@
+// $Id: bench.cpp,v 1.1 2015-01-28 16:41:09-08 - - $
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <malloc.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "commands.h"
+#include "debug.h"
+#include "dirents.h"
+#include "inode.h"
+#include "util.h"
+
+//
+// ybench -
+//    Measures how many commands per second a number of sessions can
+//    run at once against one shared tree.  The tree is DIRS
+//    directories of FILES files each.  Every session runs, over and
+//    over, nine reads (ls of a directory or cat of a file) and one
+//    mkdir of a name of its own, with output going to a string.
+//    With -a, instead counts the heap allocations made by each of
+//    cd, ls and cat, run over and over by one session.  With -d,
+//    instead times a directory's dirent_table against the map it
+//    replaced, for 10^3 entries and each power of ten up to count.
+//    Usage:  ybench [-a] [-d count] [-s seconds] [sessions...]
+//
+
+static const int DIRS = 16;
+static const int FILES = 64;
+
+// Every allocation in the program is counted.
+static atomic<size_t> allocations {0};
+
+void* operator new (size_t size) {
+   ++allocations;
+   void* memory = malloc (size == 0 ? 1 : size);
+   if (memory == nullptr) throw bad_alloc();
+   return memory;
+}
+
+void operator delete (void* memory) noexcept {
+   free (memory);
+}
+
+static void run (inode_state& state, commands& cmdmap,
+                 const string& line) {
+   static thread_local viewvec words;
+   split (line, " \t", words);
+   run_command (state, cmdmap.at (words[0]), words);
+}
+
+static void build (inode_state& state, commands& cmdmap) {
+   for (int dir = 0; dir < DIRS; ++dir) {
+      string name = "/d" + to_string (dir);
+      run (state, cmdmap, "mkdir " + name);
+      for (int file = 0; file < FILES; ++file) {
+         string file_name = name + "/f" + to_string (file);
+         run (state, cmdmap, "make " + file_name + " some words in "
+                             + file_name);
+      }
+   }
+   run (state, cmdmap, "mkdir /made");
+}
+
+static void client (inode_state& state, commands& cmdmap, int number,
+                    const atomic<bool>& stopping, size_t& count) {
+   ostringstream out;
+   session mine;
+   mine.out = &out;
+   state.attach (mine);
+   size_t ops = 0;
+   while (not stopping) {
+      size_t step = ops % 10;
+      string line;
+      if (step == 9) {
+         line = "mkdir /made/s" + to_string (number) + "_"
+              + to_string (ops);
+      }else if (step % 2 == 0) {
+         line = "ls /d" + to_string (ops % DIRS);
+      }else {
+         line = "cat /d" + to_string (ops % DIRS) + "/f"
+              + to_string (ops % FILES);
+      }
+      run (state, cmdmap, line);
+      out.str ("");
+      ++ops;
+   }
+   state.detach (mine);
+   count = ops;
+}
+
+static void count_allocations() {
+   static const int ROUNDS = 10000;
+   commands cmdmap;
+   inode_state state;
+   state.make_new_root();
+   build (state, cmdmap);
+   ostringstream out;
+   session mine;
+   mine.out = &out;
+   state.attach (mine);
+   // The lines are read into one buffer, as main reads them.
+   vector<string> lines {"cd /d3", "cd d4", "cd /", "ls /d5", "ls",
+                         "cat /d6/f7", "cat d8/f9"};
+   string line;
+   cout << "command  allocations/command" << endl;
+   for (const string& text: lines) {
+      size_t before = 0;
+      for (int round = -1; round < ROUNDS; ++round) {
+         // The first round fills the caches and grows the buffers.
+         if (round == 0) before = allocations;
+         line = text;
+         run (state, cmdmap, line);
+         out.str ("");
+         if (text.compare (0, 3, "cd ") == 0) {
+            run (state, cmdmap, line = "cd /");
+         }
+      }
+      cout << text << "  "
+           << double (allocations - before) / ROUNDS << endl;
+   }
+   state.detach (mine);
+}
+
+// Heap bytes in use, counting what the arena takes for its chunks.
+static size_t heap_bytes() {
+   struct mallinfo2 info = mallinfo2();
+   return info.uordblks + info.hblkhd;
+}
+
+static double since (chrono::steady_clock::time_point start) {
+   chrono::duration<double> took = chrono::steady_clock::now() - start;
+   return took.count();
+}
+
+//
+// time_dirents -
+//    Inserts count names, looks each of them up in another order,
+//    and lists them in name order twice, timing each step, then
+//    prints the times and the heap bytes per entry.  The first
+//    listing of a dirent_table sorts what was inserted.  The names
+//    are new symbols at each size, so the table's inserts pay for
+//    interning them, as mkdir does, and the bytes the symbol table
+//    grew by are shown apart.  Every entry is bound to the same
+//    inode, so that only the container is measured.
+//
+template <typename table_t, typename insert_t, typename find_t>
+static void time_dirents (const char* label,
+                          const vector<string>& names,
+                          inode_ptr node, table_t& table,
+                          insert_t insert, find_t find) {
+   size_t count = names.size();
+   size_t before = heap_bytes();
+   size_t symbols_before = symbols::bytes();
+   auto start = chrono::steady_clock::now();
+   for (const string& name: names) insert (table, name, node);
+   double inserting = since (start);
+   size_t symbol_bytes = symbols::bytes() - symbols_before;
+   size_t bytes = heap_bytes() - before - symbol_bytes;
+   start = chrono::steady_clock::now();
+   size_t found = 0;
+   // A stride prime to every power of ten visits each name once.
+   for (size_t step = 0, at = 0; step < count; ++step) {
+      if (find (table, names[at]) == node) ++found;
+      at = (at + 7919) % count;
+   }
+   double finding = since (start);
+   start = chrono::steady_clock::now();
+   size_t listed = 0;
+   for (const auto& entry: table) {
+      if (entry.second == node) ++listed;
+   }
+   double listing = since (start);
+   start = chrono::steady_clock::now();
+   for (const auto& entry: table) {
+      if (entry.second == node) ++listed;
+   }
+   double relisting = since (start);
+   if (found != count or listed != 2 * count) {
+      complain() << label << ": " << found << " found, " << listed
+                 << " listed of " << 2 * count << endl;
+   }
+   cout << count << "  " << label << "  " << inserting << "  "
+        << finding << "  " << listing << "  " << relisting << "  "
+        << double (bytes) / count << "  "
+        << double (symbol_bytes) / count << endl;
+}
+
+static void compare_dirents (size_t most) {
+   cout << "entries  table  insert  lookup  list  relist  "
+           "bytes/entry  symbol bytes/entry" << endl;
+   inode_state state;
+   state.make_new_root();
+   inode_ptr node = state.make_inode (PLAIN_INODE);
+   char prefix = 'a';
+   for (size_t count = 1000; count <= most; count *= 10) {
+      vector<string> names;
+      names.reserve (count);
+      for (size_t number = 0; number < count; ++number) {
+         names.push_back (prefix + to_string (number));
+      }
+      ++prefix;
+      {
+         slab_arena arena;
+         dirent_table table (&arena);
+         time_dirents ("dirents", names, node, table,
+            [] (dirent_table& into, const string& name,
+                inode_ptr node) { into.insert (name, node); },
+            [] (const dirent_table& from, const string& name) {
+               return from.find (name); });
+      }
+      {
+         map<string,inode_ptr> table;
+         time_dirents ("map", names, node, table,
+            [] (map<string,inode_ptr>& into, const string& name,
+                inode_ptr node) { into.emplace (name, node); },
+            [] (const map<string,inode_ptr>& from,
+                const string& name) {
+               auto itor = from.find (name);
+               return itor == from.end() ? nullptr : itor->second;
+            });
+      }
+   }
+}
+
+static double measure (int sessions, double seconds) {
+   commands cmdmap;
+   inode_state state;
+   state.make_new_root();
+   build (state, cmdmap);
+   atomic<bool> stopping {false};
+   vector<size_t> counts (sessions);
+   vector<thread> threads;
+   auto start = chrono::steady_clock::now();
+   for (int number = 0; number < sessions; ++number) {
+      threads.push_back (thread (client, ref (state), ref (cmdmap),
+                                 number, cref (stopping),
+                                 ref (counts[number])));
+   }
+   this_thread::sleep_for (chrono::duration<double> (seconds));
+   stopping = true;
+   for (thread& each: threads) each.join();
+   chrono::duration<double> took = chrono::steady_clock::now() - start;
+   size_t total = 0;
+   for (size_t count: counts) total += count;
+   return total / took.count();
+}
+
+int main (int argc, char** argv) {
+   execname (argv[0]);
+   double seconds = 2;
+   bool allocating = false;
+   size_t entries = 0;
+   for (;;) {
+      int option = getopt (argc, argv, "@:ad:s:");
+      if (option == EOF) break;
+      switch (option) {
+         case '@':
+            debugflags::setflags (optarg);
+            break;
+         case 'a':
+            allocating = true;
+            break;
+         case 'd':
+            entries = strtoul (optarg, nullptr, 10);
+            break;
+         case 's':
+            seconds = atof (optarg);
+            break;
+         default:
+            complain() << "-" << (char) option << ": invalid option"
+                       << endl;
+            return exit_status::get();
+      }
+   }
+   if (allocating) {
+      count_allocations();
+      return exit_status::get();
+   }
+   if (entries > 0) {
+      compare_dirents (entries);
+      return exit_status::get();
+   }
+   vector<int> sessions;
+   for (int arg = optind; arg < argc; ++arg) {
+      sessions.push_back (max (atoi (argv[arg]), 1));
+   }
+   if (sessions.empty()) sessions = {1, 2, 4, 8};
+   cout << "hardware threads: " << thread::hardware_concurrency()
+        << endl;
+   cout << "sessions  ops/sec" << endl;
+   for (int count: sessions) {
+      cout << count << "  " << size_t (measure (count, seconds))
+           << endl;
+   }
+   return exit_status::get();
+}
+
@@ -1,26 +1,56 @@
 // $Id: commands.cpp,v 1.11 2014-06-11 13:49:31-07 - - $
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <streambuf>
+#include <unordered_set>
+
 #include "commands.h"
 #include "debug.h"
+#include "hostfs.h"
+#include "image.h"
+#include "symbols.h"
+#include "workpool.h"
 
 commands::commands(): map ({
+   {"append", fn_append},
    {"cat"   , fn_cat   },
    {"cd"    , fn_cd    },
+   {"compact", fn_compact},
+   {"cp"    , fn_cp    },
+   {"du"    , fn_du    },
    {"echo"  , fn_echo  },
    {"exit"  , fn_exit  },
+   {"find"  , fn_find  },
+   {"grep"  , fn_grep  },
+   {"import", fn_import},
+   {"load"  , fn_load  },
    {"ls"    , fn_ls    },
    {"lsr"   , fn_lsr   },
    {"make"  , fn_make  },
+   {"mem"   , fn_mem   },
    {"mkdir" , fn_mkdir },
+   {"mount" , fn_mount },
+   {"mv"    , fn_mv    },
    {"prompt", fn_prompt},
    {"pwd"   , fn_pwd   },
+   {"restore", fn_restore},
    {"rm"    , fn_rm    },
    {"rmr"   , fn_rmr    },
+   {"save"  , fn_save  },
+   {"snapshot", fn_snapshot},
+   {"snapshots", fn_snapshots},
+   {"stat"  , fn_stat  },
+   {"stats" , fn_stats },
+   {"write" , fn_write },
 }){}
 
-command_fn commands::at (const string& cmd) {
+command_fn commands::at (strview cmd) {
    // Note: value_type is pair<const key_type, mapped_type>
-   // So: iterator->first is key_type (string)
+   // So: iterator->first is key_type (strview)
    // So: iterator->second is mapped_type (command_fn)
    command_map::const_iterator result = map.find (cmd);
    if (result == map.end()) {
@@ -29,18 +59,49 @@ command_fn commands::at (const string& cmd) {
    return result->second;
 }
 
-void preorder_traversal(inode_ptr curr_inode, string path);
-void postorder_traversal(inode_ptr curr_inode);
+void print_dirents(ostream& out, directory_ptr the_contents);
+void preorder_traversal(inode_state& state, inode_ptr head);
+void parallel_preorder_traversal(ostream& out, inode_ptr head,
+                                 const string& head_path);
+void postorder_traversal(inode_state& state, inode_ptr curr_inode);
+void unindex_subtree(inode_state& state, inode_ptr head);
 
-inode_ptr go_to_path(inode_state& state, const wordvec &words,
+inode_ptr go_to_path(inode_state& state, const viewvec &words,
                      int destination, int control);
+void split_last(strview pathname, strview& dir, strview& last);
+inode_ptr go_to_target(inode_state& state, const viewvec& words,
+                       int destination, strview source_name,
+                       string& name);
+bool is_below(inode_ptr node, inode_ptr dir);
+inode_ptr go_to_file(inode_state& state, const viewvec& words,
+                     int destination, inode_ptr& parent);
+string child_path(const string& parent_path, const string& name);
 
 
 
 string wordvec_to_string(wordvec &words);
 
 
-void fn_cat (inode_state& state, const wordvec& words){
+void fn_append (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   //Case: Bad arguments
+   if ( words.size() < 2 )
+   {
+      throw yshell_exn("append: Usage: append file [words...]");
+   }
+   inode_ptr parent;
+   inode_ptr file = go_to_file(state, words, 1, parent);
+   plain_file_ptr contents = file->get_plain_contents();
+   long before = contents->size();
+   contents->append(words.begin() + 2, words.end());
+   parent->adjust_total(long(contents->size()) - before);
+   state.get_index().extend(file, parent, words.begin() + 2,
+                            words.end());
+}
+
+void fn_cat (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -53,8 +114,8 @@ void fn_cat (inode_state& state, const wordvec& words){
    // Attempt to cat the file
    else
    {
-      wordvec_itor itor = words.begin() + 1;
-      const wordvec_itor end = words.end();
+      viewvec_itor itor = words.begin() + 1;
+      const viewvec_itor end = words.end();
       for (int i = 1; itor != end; ++itor, ++i)
       {
        inode_ptr target = go_to_path(state, words, i, 0);
@@ -76,7 +137,8 @@ void fn_cat (inode_state& state, const wordvec& words){
         // Final check, then out the file contents
         else if ( target != nullptr )
         {
-           cout << target->get_plain_contents()->readfile() << endl;
+           target->get_plain_contents()->printfile(state.out());
+           state.out() << endl;
         } 
         // All checks failed, so throw an error. 
         else
@@ -93,7 +155,7 @@ void fn_cat (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_cd (inode_state& state, const wordvec& words){
+void fn_cd (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -131,7 +193,7 @@ void fn_cd (inode_state& state, const wordvec& words){
    else 
    {
        error += "cd:";
-       wordvec_itor itor = words.begin() + 1;
+       viewvec_itor itor = words.begin() + 1;
        while ( itor != words.end() ) error += " " + *itor++;
        error += ": No such file or directory";
    }
@@ -142,7 +204,115 @@ void fn_cd (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_echo (inode_state& state, const wordvec& words){
+void fn_compact (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Case: Bad arguments
+   if ( words.size() != 1 )
+   {
+      throw yshell_exn("compact: Usage: compact");
+   }
+   state.compact();
+}
+
+void fn_cp (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   string error("");
+   bool recursive = words.size() == 4 && words[1] == "-r";
+   //Case: Bad arguments
+   if ( words.size() != 3 && not recursive )
+   {
+      throw yshell_exn("cp: Usage: cp [-r] source target");
+   }
+   int first = recursive ? 2 : 1;
+   inode_ptr source = go_to_path(state, words, first, 0);
+   strview dir, last;
+   split_last(words[first], dir, last);
+   string name;
+   inode_ptr target = nullptr;
+   if ( source == nullptr )
+   {
+      error += "cp: " + words[first] + ": No such file or directory";
+   }
+   else if ( source->is_dir() && not recursive )
+   {
+      error += "cp: " + words[first] + ": Is a directory";
+   }
+   else
+   {
+      target = go_to_target(state, words, first + 1, last, name);
+      if ( target == nullptr || name.empty() || name == "." ||
+           name == ".." )
+      {
+         error += "cp: " + words[first + 1] + ": Invalid target";
+      }
+      else if ( target->get_child_dir(name) != nullptr )
+      {
+         error += "cp: directory/file already exists with name: "
+                + name;
+      }
+   }
+   if ( error.size() > 0 )
+   {
+      throw yshell_exn(error);
+   }
+   //The copy shares everything with the source, and is only filled
+   //in as far as it is looked into
+   inode_ptr copy = state.copy_subtree(source);
+   copy->set_name(name);
+   target = state.writable(target);
+   copy->set_parent(target);
+   target->add_dirent(name, copy);
+   target->adjust_total(copy->get_total_size());
+   state.get_dcache().enter(target, name, copy);
+   if ( copy->is_file() )
+   {
+      state.get_index().add(copy, target);
+      state.get_names().add(name, copy, target);
+   }
+   //What is below a directory copy is not there to be indexed
+   //until it is filled in, so the indexes are rebuilt, as after a
+   //load
+   else
+   {
+      state.get_index().invalidate();
+      state.get_names().invalidate();
+   }
+}
+
+void fn_du (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   string error;
+   //Case: No arguments, so report the current directory
+   if ( words.size() == 1 )
+   {
+      inode_ptr cwd = state.getcwd();
+      state.out() << cwd->get_total_size() << "  "
+                  << path_of(state, cwd) << endl;
+   }
+   //Case: Arguments, so report each one from its cached total
+   else
+   {
+      for (size_t i = 1; i < words.size(); ++i)
+      {
+         inode_ptr target = go_to_path(state, words, i, 0);
+         if ( target == nullptr )
+         {
+            error += "du: " + words[i] + ": No such file or directory";
+            throw yshell_exn(error);
+         }
+         state.out() << target->get_total_size() << "  " << words[i]
+                     << endl;
+      }
+   }
+}
+
+void fn_echo (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -151,8 +321,8 @@ void fn_echo (inode_state& state, const wordvec& words){
    if ( words.size() > 1 )
    {
       // Iterate, add words to a string
-      wordvec_itor itor = words.begin() + 1;
-      const wordvec_itor end = words.end();
+      viewvec_itor itor = words.begin() + 1;
+      const viewvec_itor end = words.end();
       for (; itor != end; ++itor) {
          output += *itor;
          output += " ";
@@ -160,10 +330,10 @@ void fn_echo (inode_state& state, const wordvec& words){
       output.erase(output.end()-1);
    }
    //Output the string of collected words
-   cout << output << endl;
+   state.out() << output << endl;
 }
 
-void fn_exit (inode_state& state, const wordvec& words){
+void fn_exit (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -171,13 +341,211 @@ void fn_exit (inode_state& state, const wordvec& words){
    //Check if an exit code is requested
    if ( words.size() > 1 )
    {
-      code = atoi(words[1].c_str());
+      code = atoi(words[1].str().c_str());
       exit_status::set(code);
    }
    throw ysh_exit_exn();
 }
 
-void fn_ls (inode_state& state, const wordvec& words){
+void fn_find (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Read the options.  A size is in bytes for a file and in
+   //dirents for a directory, as ls shows them, and may be more
+   //than (+n), less than (-n) or exactly (n) the given number.
+   string usage("find: Usage: find [path] [-name pattern] "
+                "[-type f|d] [-size [+|-]n]");
+   string pattern("*");
+   string type;
+   char size_test = 0;
+   size_t size = 0;
+   string prefix("/");
+   size_t i = 1;
+   if ( i < words.size() && words[i].at(0) != '-' )
+   {
+      inode_ptr target = go_to_path(state, words, i, 0);
+      if ( target == nullptr || target->is_file() )
+      {
+         throw yshell_exn("find: " + words[i] + ": No such directory");
+      }
+      prefix = path_of(state, target);
+      ++i;
+   }
+   for (; i < words.size(); i += 2)
+   {
+      if ( i + 1 == words.size() ) throw yshell_exn(usage);
+      const string& value = words[i + 1];
+      if ( words[i] == "-name" )
+      {
+         pattern = value;
+      }
+      else if ( words[i] == "-type" && (value == "f" || value == "d") )
+      {
+         type = value;
+      }
+      else if ( words[i] == "-size" &&
+                value.find_first_not_of("+-0123456789")
+                == string::npos )
+      {
+         size_test = value.at(0) == '+' || value.at(0) == '-'
+                   ? value.at(0) : '=';
+         size = strtoul(value.c_str() + (size_test != '='),
+                        nullptr, 10);
+      }
+      else
+      {
+         throw yshell_exn(usage);
+      }
+   }
+   //Answer from the name index, then put the paths in order
+   state.index_tree(false, true);
+   vector<string> found;
+   for (const name_index::found& hit: state.get_names().match(pattern))
+   {
+      if ( type == "f" && hit.node->is_dir() ) continue;
+      if ( type == "d" && hit.node->is_file() ) continue;
+      if ( size_test != 0 )
+      {
+         size_t node_size = hit.node->is_dir()
+               ? hit.node->get_directory_contents()->size()
+               : hit.node->get_plain_contents()->size();
+         if ( (size_test == '+' && node_size <= size) ||
+              (size_test == '-' && node_size >= size) ||
+              (size_test == '=' && node_size != size) ) continue;
+      }
+      string path = child_path(path_of(state, hit.parent),
+                               hit.node->get_name());
+      if ( prefix.compare("/") == 0 ||
+           path.compare(0, prefix.size() + 1, prefix + "/") == 0 )
+      {
+         found.push_back(path);
+      }
+   }
+   sort(found.begin(), found.end());
+   for (const string& path: found)
+   {
+      state.out() << path << endl;
+   }
+}
+
+void fn_grep (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Case: Bad arguments
+   if ( words.size() != 2 && words.size() != 3 )
+   {
+      throw yshell_exn("grep: Usage: grep word[+word][,word] [path]");
+   }
+   //Only files at or below the path are reported
+   string prefix("/");
+   if ( words.size() == 3 )
+   {
+      inode_ptr target = go_to_path(state, words, 2, 0);
+      if ( target == nullptr )
+      {
+         throw yshell_exn("grep: " + words[2] +
+                          ": No such file or directory");
+      }
+      if ( target->is_dir() )
+      {
+         prefix = path_of(state, target);
+      }
+      else
+      {
+         inode_ptr parent = go_to_path(state, words, 2, 1);
+         prefix = child_path(path_of(state, parent), target->get_name());
+      }
+   }
+   //Answer from the word index, then put the paths in order
+   state.index_tree(true, false);
+   word_index& index = state.get_index();
+   vector<string> found;
+   for (int file_nr: index.query(words[1]))
+   {
+      inode_ptr file;
+      inode_ptr parent;
+      index.locate(file_nr, file, parent);
+      if ( file == nullptr || parent == nullptr ) continue;
+      string path = child_path(path_of(state, parent),
+                               file->get_name());
+      if ( prefix.compare("/") == 0 || path == prefix ||
+           path.compare(0, prefix.size() + 1, prefix + "/") == 0 )
+      {
+         found.push_back(path);
+      }
+   }
+   sort(found.begin(), found.end());
+   for (const string& path: found)
+   {
+      state.out() << path << endl;
+   }
+}
+
+void fn_import (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   string error("");
+   //Case: Bad arguments
+   if ( words.size() != 3 )
+   {
+      throw yshell_exn("import: Usage: import host-directory target");
+   }
+   inode_ptr target = go_to_path(state, words, 2, 1);
+   strview dir, last;
+   split_last(words[2], dir, last);
+   string name(last.str());
+   if ( target == nullptr || not target->is_dir() || name.empty() ||
+        name == "." || name == ".." )
+   {
+      error += "import: " + words[2] + ": Invalid target";
+   }
+   else if ( target->get_child_dir(name) != nullptr )
+   {
+      error += "import: directory/file already exists with name: "
+             + name;
+   }
+   if ( error.size() > 0 )
+   {
+      throw yshell_exn(error);
+   }
+   //The whole host tree is read in before any of it is linked in,
+   //so a lookup never finds it half built
+   string skipped;
+   inode_ptr tree = import_tree(state, words[1].str(), skipped);
+   tree->set_name(name);
+   target = state.writable(target);
+   tree->set_parent(target);
+   target->add_dirent(name, tree);
+   target->adjust_total(tree->get_total_size());
+   state.get_dcache().enter(target, name, tree);
+   //The indexes are rebuilt, as after a load, rather than fed every
+   //file one at a time
+   state.get_index().invalidate();
+   state.get_names().invalidate();
+   if ( skipped.size() > 0 )
+   {
+      throw yshell_exn("import: " + skipped);
+   }
+}
+
+void fn_load (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Case: Bad arguments
+   if ( words.size() != 2 )
+   {
+      throw yshell_exn("load: Invalid image name");
+   }
+   //Map the image in place of the whole tree.  Nothing below the
+   //root is made until it is looked at.
+   load_image(state, words[1]);
+}
+
+void fn_ls (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -186,53 +554,20 @@ void fn_ls (inode_state& state, const wordvec& words){
    if ( words.size() == 1 )
    {
     inode_ptr cwd = state.getcwd();
-    cout << cwd->get_name() << ":" << endl;
+    state.out() << cwd->get_name() << ":" << endl;
   
-    inode_ptr currDir = state.getcwd();
-    directory_ptr the_contents = directory_ptr_of(
-                                 currDir->get_contents());
-    map<string, inode_ptr>::iterator itor = 
-                            the_contents->get_dirents()->begin();
-    map<string, inode_ptr>::const_iterator end = 
-                            the_contents->get_dirents()->end();
-    // Iterate through this inode's map
-    for (; itor != end; ++itor)
-    {
-        //Print the inode number
-        cout << itor->second->get_inode_nr() << "  " ;
-
-        //Print either the directory or file size
-        if(itor->second->is_dir())
-        {
-          cout << itor->second->get_directory_contents()->size() 
-          << "  " ;
-        }
-        else
-        {
-          cout << itor->second->get_plain_contents()->size()
-          << "  ";
-        }
-
-        //Print the "/" next to a directory, not a file.
-        if(itor->second->is_dir() && (itor->first.compare(".") != 0)
-                            && (itor->first.compare("..") != 0) )
-        {
-              cout << itor->first << "/" <<endl;
-        }
-        else
-        {
-             cout << itor->first <<endl;
-        }
-    } 
+    directory_ptr contents = directory_ptr_of(cwd->get_contents());
+    directory::read_guard guard(*contents);
+    print_dirents(state.out(), contents);
  }
 
    // Case: More than one argument
    else
    {
       inode_ptr target;
-      wordvec_itor itor = words.begin();
+      viewvec_itor itor = words.begin();
       ++itor;
-      wordvec_itor end = words.end();
+      viewvec_itor end = words.end();
       // Iterate to the path
       for (int i = 1; itor != end; ++itor, ++i)
       {
@@ -256,44 +591,11 @@ void fn_ls (inode_state& state, const wordvec& words){
         // All checks passed attempt to ls the directory
          else
          {
-          // Iterate through this inode's map
-           directory_ptr the_contents = directory_ptr_of(target->
-                                           get_contents());
-           map<string, inode_ptr>::iterator itor = 
-                        the_contents->get_dirents()->begin();
-           map<string, inode_ptr>::const_iterator end = 
-                         the_contents->get_dirents()->end();
-            cout << words[i] << ":" << endl;
-
-           for (; itor != end; ++itor)
-                {
-                 //Print the inode number
-                 cout << itor->second->get_inode_nr() << "  " ;
-                 //Print either the directory or file size
-                 if(itor->second->is_dir())
-                 {
-                   cout << itor->second->get_directory_contents()->
-                                                  size() << "  " ;
-                 }
-                 else
-                 {
-                  cout << itor->second->get_plain_contents()->
-                                               size() << "  ";
-                 }
-
-                 //Print the directory "/" next to a directory
-                 if(itor->second->is_dir() && 
-                (itor->first.compare(".") != 0) && 
-                (itor->first.compare("..") != 0) )
-                {
-                       cout << itor->first << "/" <<endl;
-                }
-                else
-                {
-                      cout << itor->first <<endl;
-                }
-
-          }
+           state.out() << words[i] << ":" << endl;
+           directory_ptr contents =
+                 directory_ptr_of(target->get_contents());
+           directory::read_guard guard(*contents);
+           print_dirents(state.out(), contents);
         }
       }
    }
@@ -303,7 +605,7 @@ void fn_ls (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_lsr (inode_state& state, const wordvec& words){
+void fn_lsr (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -314,14 +616,13 @@ void fn_lsr (inode_state& state, const wordvec& words){
    if ( words.size() == 1 )
    {
       head = state.getcwd();
-      string n;
-      preorder_traversal(head, n);
+      preorder_traversal(state, head);
    }
    //Case: More than one argument
    else {
-      wordvec_itor itor = words.begin();
+      viewvec_itor itor = words.begin();
       ++itor;
-      wordvec_itor end = words.end();
+      viewvec_itor end = words.end();
        // Iterate through this inode's map
       for (int i = 1; itor!=end; ++itor, ++i)
       {
@@ -337,8 +638,7 @@ void fn_lsr (inode_state& state, const wordvec& words){
             throw yshell_exn(error);
             return;
           }
-           string n;
-           preorder_traversal(head, n);
+           preorder_traversal(state, head);
         }
          //Otherwise there was an error
          else 
@@ -355,7 +655,7 @@ void fn_lsr (inode_state& state, const wordvec& words){
 }
 
 
-void fn_make (inode_state& state, const wordvec& words){
+void fn_make (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -369,25 +669,35 @@ void fn_make (inode_state& state, const wordvec& words){
    else 
    {
       inode_ptr target_parent = go_to_path(state, words, 1, 1);
-      //Check to make sure the traverse was successful
-      if ( target_parent != nullptr )
+      strview dir, last;
+      split_last(words[1], dir, last);
+      //Check to make sure the traverse was successful, and that
+      //there is a name to make
+      if ( target_parent != nullptr && not last.empty() )
       {
          bool newfile = false;
-         wordvec path = split(words[1], "/" );
-         string dirname(path[path.size()-1]);
+         string dirname(last.str());
          inode_ptr targetfile = target_parent->get_child_dir(dirname);
          //If a file doesn't exist, create it
          if ( targetfile == nullptr )
          {
-            inode temp(PLAIN_INODE);
-            inode_ptr newFil = make_shared<inode>(temp);
-            newFil->set_name(wordvec_to_string(path));
-            newfile = true;
+            target_parent = state.writable(target_parent);
+            inode_ptr newFil = state.make_inode(PLAIN_INODE);
+            newFil->set_name(dirname);
             newFil->get_plain_contents()->writefile(words);
+            //Another session may have made it since the lookup
+            newfile = target_parent->add_file(dirname, newFil);
             if ( newfile == true )
             {
-               string name(words[1]);
-               target_parent->add_file(dirname, newFil);
+               target_parent->adjust_total(newFil->get_total_size());
+               state.get_index().add(newFil, target_parent);
+               state.get_names().add(dirname, newFil, target_parent);
+               state.get_dcache().enter(target_parent, dirname, newFil);
+            }
+            else
+            {
+               error+="make: directory/file already exists with name: "
+                    +  words[1];
             }
          }
         //Otherwise the file exists, so error out.
@@ -410,7 +720,22 @@ void fn_make (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_mkdir (inode_state& state, const wordvec& words){
+void fn_mem (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Report what the tree is holding on to right now
+   const slab_arena& arena = state.get_arena();
+   state.out() << "inodes: " << inode::get_live_count() << endl;
+   state.out() << "bytes in use: " << arena.bytes_in_use() << endl;
+   state.out() << "bytes reserved: " << arena.bytes_reserved()
+               << endl;
+   const inode_table& inodes = state.get_inodes();
+   state.out() << "inode slots: " << inodes.slot_count() << endl;
+   state.out() << "inode table bytes: " << inodes.bytes() << endl;
+}
+
+void fn_mkdir (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -425,11 +750,12 @@ void fn_mkdir (inode_state& state, const wordvec& words){
    else if ( words.size() == 2)
    {
       inode_ptr target = go_to_path(state, words, 1, 1);
-      if ( target != nullptr )
+      strview dir, last;
+      split_last(words.at(1), dir, last);
+      if ( target != nullptr && not last.empty() )
       {
         //Check if the directory exists
-        wordvec path = split(words.at(1),"/");
-        if ( target->get_child_dir(path[path.size()-1]) != nullptr )
+        if ( target->get_child_dir(last) != nullptr )
         {
             error += 
             "mkdir: Directory or File already exists with that name";
@@ -437,11 +763,24 @@ void fn_mkdir (inode_state& state, const wordvec& words){
         //Otherwise success, so make the directory
         else 
         {
-        inode_ptr newDir = make_shared<inode>(DIR_INODE);
-        target->add_dirent(path.at(path.size()-1), newDir);
+        target = state.writable(target);
+        inode_ptr newDir = state.make_inode(DIR_INODE);
         newDir->set_self(newDir);
         newDir->set_parent(target);
-        newDir->set_name(wordvec_to_string(path));
+        newDir->set_name(last);
+        //Other sessions see it as soon as it is linked in, and one
+        //of them may have made the same name since the lookup
+        if ( target->add_dirent(last, newDir) )
+        {
+           state.get_dcache().enter(target,
+                                    newDir->get_name(), newDir);
+           state.get_names().add(newDir->get_name(), newDir, target);
+        }
+        else
+        {
+           error += 
+           "mkdir: Directory or File already exists with that name";
+        }
         }
       }
        //Otherwise there was an error
@@ -456,7 +795,136 @@ void fn_mkdir (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_prompt (inode_state& state, const wordvec& words){
+void fn_mount (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   string error("");
+   //Case: Bad arguments
+   if ( words.size() != 3 )
+   {
+      throw yshell_exn("mount: Usage: mount host-directory target");
+   }
+   inode_ptr target = go_to_path(state, words, 2, 1);
+   strview dir, last;
+   split_last(words[2], dir, last);
+   string name(last.str());
+   if ( target == nullptr || not target->is_dir() || name.empty() ||
+        name == "." || name == ".." )
+   {
+      error += "mount: " + words[2] + ": Invalid target";
+   }
+   else if ( target->get_child_dir(name) != nullptr )
+   {
+      error += "mount: directory/file already exists with name: "
+             + name;
+   }
+   if ( error.size() > 0 )
+   {
+      throw yshell_exn(error);
+   }
+   //Nothing below the mount is made until it is looked at
+   inode_ptr mount = mount_tree(state, words[1].str());
+   mount->set_name(name);
+   target = state.writable(target);
+   mount->set_parent(target);
+   target->add_dirent(name, mount);
+   state.get_dcache().enter(target, name, mount);
+   //What is below the mount is not there to be indexed until it is
+   //listed, so the indexes are rebuilt, as after a cp -r
+   state.get_index().invalidate();
+   state.get_names().invalidate();
+}
+
+void fn_mv (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   string error("");
+   //Case: Bad arguments
+   if ( words.size() != 3 )
+   {
+      throw yshell_exn("mv: Usage: mv source target");
+   }
+   inode_ptr source = go_to_path(state, words, 1, 0);
+   strview dir, last;
+   split_last(words[1], dir, last);
+   string name;
+   inode_ptr target = nullptr;
+   if ( source == nullptr )
+   {
+      error += "mv: " + words[1] + ": No such file or directory";
+   }
+   else if ( last.empty() || last == "." || last == ".." )
+   {
+      error += "mv: Cannot move '/', '.' or '..'";
+   }
+   else
+   {
+      target = go_to_target(state, words, 2, last, name);
+      if ( target == nullptr || name.empty() || name == "." ||
+           name == ".." )
+      {
+         error += "mv: " + words[2] + ": Invalid target";
+      }
+      else if ( target->get_child_dir(name) != nullptr )
+      {
+         error += "mv: directory/file already exists with name: "
+                + name;
+      }
+      else if ( source->is_dir() && is_below(target, source) )
+      {
+         error += "mv: Cannot move a directory below itself";
+      }
+   }
+   if ( error.size() > 0 )
+   {
+      throw yshell_exn(error);
+   }
+   //Unlink it from where it was.  Copying the source side may have
+   //copied the target too, so the target is looked up again after.
+   string old_name(last.str());
+   inode_ptr from = go_to_path(state, words, 1, 1);
+   string old_path = child_path(path_of(state, from), old_name);
+   inode_ptr moved = state.renamable(source);
+   from = state.writable(moved->is_dir() ? moved->get_parent() : from);
+   from->delete_child(old_name);
+   from->adjust_total(-moved->get_total_size());
+   dentry_cache& dcache = state.get_dcache();
+   dcache.forget(from->get_inode_nr(), old_name);
+   if ( moved->is_dir() )
+   {
+      dcache.forget(moved->get_inode_nr(), "..");
+      state.paths_changed();
+   }
+   dcache.forget_path(old_path);
+   //Then link it in where it goes
+   target = state.writable(go_to_target(state, words, 2, last, name));
+   if ( name != old_name )
+   {
+      moved->set_name(name);
+   }
+   moved->set_parent(target);
+   target->add_dirent(name, moved);
+   target->adjust_total(moved->get_total_size());
+   dcache.enter(target, name, moved);
+   state.get_names().remove(old_name, moved->get_inode_nr());
+   state.get_names().add(name, moved, target);
+   if ( moved->is_file() )
+   {
+      if ( moved == source )
+      {
+         state.get_index().move(moved->get_inode_nr(), target);
+      }
+      //A frozen file was copied to be renamed
+      else
+      {
+         state.get_index().add(moved, target);
+      }
+   }
+}
+
+void fn_prompt (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
   
@@ -468,7 +936,7 @@ void fn_prompt (inode_state& state, const wordvec& words){
    }
    
    //Initialize the new prompt
-   wordvec prompt_vec = words;
+   viewvec prompt_vec = words;
    prompt_vec.erase (prompt_vec.begin());
    string prompt_string;
    
@@ -498,30 +966,30 @@ void fn_prompt (inode_state& state, const wordvec& words){
    }
 }
 
-void fn_pwd (inode_state& state, const wordvec& words){
+void fn_pwd (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words); 
    
-   string path("");
-   path += state.getcwd()->get_name();
-   inode_ptr parent = state.getcwd()->get_parent();
-   //Doesn't use words, so go ahead and begin making path
-   while (parent->get_inode_nr() !=
-          state.getroot()->get_inode_nr() )
+   //Doesn't use words, so go ahead and out the path
+   state.out() << path_of(state, state.getcwd()) << endl;
+}
+
+void fn_restore (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Case: Bad arguments
+   if ( words.size() != 2 )
    {
-     path = parent->get_name() + "/" + path;
-     parent = parent->get_parent();
+      throw yshell_exn("restore: Invalid snapshot name");
    }
-   //Insert proper '/' character
-   if (path.compare("/") != 0)
+   if ( not state.restore_snapshot(words[1]) )
    {
-     path = "/" + path;
+      throw yshell_exn("restore: " + words[1] + ": No such snapshot");
    }
-   //Out the path
-   cout << path << endl;
 }
 
-void fn_rm (inode_state& state, const wordvec& words){
+void fn_rm (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -543,20 +1011,38 @@ void fn_rm (inode_state& state, const wordvec& words){
              target->get_directory_contents()->size() <= 2 ) || 
              !target->is_dir() )
             {
-              inode_ptr target_parent = go_to_path(
-                                        state, words, 1, 1);
-              wordvec path = split(words[1],"/");
+              inode_ptr target_parent = state.writable(go_to_path(
+                                        state, words, 1, 1));
+              strview dir, last;
+              split_last(words[1], dir, last);
               //Make sure you can't delete . or .. 
-              if ( target_parent->delete_child( path[path.size()-1] ) 
+              if ( target_parent->delete_child( last ) 
                  == false )
               {
                 error += "rm: Cannot delete '.' or '..'";
               }
-              //Otherwise, success.
+              //Otherwise, success, so drop it from the totals and
+              //the dentry cache.
               else
               {
-               // Do nothing, success.
-               //cout << "Sucessfully deleted the child node" << endl;
+                target_parent->adjust_total(-target->get_total_size());
+                if ( target->is_file() )
+                {
+                   state.get_index().remove(target);
+                }
+                state.get_names().remove(last,
+                                         target->get_inode_nr());
+                dentry_cache& dcache = state.get_dcache();
+                dcache.forget(target_parent->get_inode_nr(),
+                              last);
+                if ( target->is_dir() )
+                {
+                   dcache.forget(target->get_inode_nr(), ".");
+                   dcache.forget(target->get_inode_nr(), "..");
+                   state.paths_changed();
+                }
+                dcache.forget_path(child_path(
+                   path_of(state, target_parent), last));
               }
       
            }
@@ -579,7 +1065,179 @@ void fn_rm (inode_state& state, const wordvec& words){
 }
 
 
-void fn_rmr (inode_state& state, const wordvec& words){
+void fn_save (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Case: Bad arguments
+   if ( words.size() != 2 )
+   {
+      throw yshell_exn("save: Invalid image name");
+   }
+   save_image(state, words[1]);
+}
+
+void fn_snapshot (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Case: Drop a snapshot
+   if ( words.size() == 3 && words[1] == "-d" )
+   {
+      if ( not state.drop_snapshot(words[2]) )
+      {
+         throw yshell_exn("snapshot: " + words[2] +
+                          ": No such snapshot");
+      }
+   }
+   //Case: Take one, which only freezes the tree
+   else if ( words.size() == 2 )
+   {
+      state.take_snapshot(words[1]);
+   }
+   else
+   {
+      throw yshell_exn("snapshot: Invalid snapshot name");
+   }
+}
+
+void fn_snapshots (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Mark everything the current tree holds.  Below a frozen
+   //directory everything is frozen too, so only the directories
+   //the current tree has copied need to be walked.
+   unordered_set<const inode*> current;
+   vector<inode_ptr> stack {state.getroot()};
+   while ( not stack.empty() )
+   {
+      inode_ptr node = stack.back();
+      stack.pop_back();
+      current.insert(node.get());
+      if ( node->is_file() || state.is_frozen(node) ) continue;
+      directory_ptr contents = node->get_directory_contents();
+      if ( not contents->is_loaded() ) continue;
+      for (directory::const_iterator itor = contents->begin();
+           itor != contents->end(); ++itor)
+      {
+         if ( itor->first.compare(".") != 0 &&
+              itor->first.compare("..") != 0 )
+         {
+            stack.push_back(itor->second);
+         }
+      }
+   }
+   //A snapshot's overhead is whatever it holds that the current
+   //tree does not.  Inodes shared by two snapshots count for both.
+   for (const auto& entry: state.get_snapshots())
+   {
+      size_t inodes = 0;
+      size_t bytes = 0;
+      stack.push_back(entry.second.root);
+      while ( not stack.empty() )
+      {
+         inode_ptr node = stack.back();
+         stack.pop_back();
+         if ( current.count(node.get()) > 0 ) continue;
+         ++inodes;
+         bytes += node->footprint();
+         if ( node->is_file() ) continue;
+         directory_ptr contents = node->get_directory_contents();
+         if ( not contents->is_loaded() ) continue;
+         for (directory::const_iterator itor = contents->begin();
+              itor != contents->end(); ++itor)
+         {
+            if ( itor->first.compare(".") != 0 &&
+                 itor->first.compare("..") != 0 )
+            {
+               stack.push_back(itor->second);
+            }
+         }
+      }
+      state.out() << entry.first << ": " << inodes << " inodes, "
+                  << bytes << " bytes" << endl;
+   }
+}
+
+void fn_stat (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   string usage("stat: Usage: stat path | stat -i inode_nr");
+   inode_ptr target;
+   //Case: An inode number, resolved straight from the inode table
+   if ( words.size() == 3 && words[1] == "-i" )
+   {
+      string number = words[2];
+      if ( number.size() > 9 ||
+           number.find_first_not_of("0123456789") != string::npos )
+      {
+         throw yshell_exn(usage);
+      }
+      target = state.find_inode(atoi(number.c_str()));
+      if ( target == nullptr )
+      {
+         throw yshell_exn("stat: " + number + ": No such inode");
+      }
+   }
+   //Case: A path
+   else if ( words.size() == 2 )
+   {
+      target = go_to_path(state, words, 1, 0);
+      if ( target == nullptr )
+      {
+         throw yshell_exn("stat: " + words[1] +
+                          ": No such file or directory");
+      }
+   }
+   else
+   {
+      throw yshell_exn(usage);
+   }
+   //Sizes are as ls shows them, and a directory also has its path
+   state.out() << "inode: " << target->get_inode_nr() << endl;
+   if ( target->is_dir() )
+   {
+      state.out() << "type: directory" << endl;
+      state.out() << "name: " << target->get_name() << endl;
+      state.out() << "size: "
+                  << target->get_directory_contents()->size() << endl;
+      state.out() << "path: " << path_of(state, target) << endl;
+   }
+   else
+   {
+      state.out() << "type: file" << endl;
+      state.out() << "name: " << target->get_name() << endl;
+      state.out() << "size: "
+                  << target->get_plain_contents()->size() << endl;
+   }
+   state.out() << "total: " << target->get_total_size() << endl;
+}
+
+void fn_stats (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+   
+   //Report how much sharing file contents saves.  The bytes are
+   //those of the arena the words take up.
+   content_store::stats stats = state.get_store().get_stats();
+   double ratio = stats.stored_bytes == 0 ? 1.0
+                : double(stats.logical_bytes) / stats.stored_bytes;
+   state.out() << "files: " << stats.files << endl;
+   state.out() << "distinct contents: " << stats.payloads << endl;
+   state.out() << "bytes unshared: " << stats.logical_bytes << endl;
+   state.out() << "bytes stored: " << stats.stored_bytes << endl;
+   state.out() << "bytes saved: "
+               << stats.logical_bytes - stats.stored_bytes << endl;
+   state.out() << "dedup ratio: " << fixed << setprecision(2)
+               << ratio << defaultfloat << endl;
+   //Names and words are interned once for the whole program.
+   state.out() << "symbols: " << symbols::count() << endl;
+   state.out() << "symbol bytes: " << symbols::bytes() << endl;
+}
+
+void fn_rmr (inode_state& state, const viewvec& words){
    DEBUGF ('c', state);
    DEBUGF ('c', words);
    
@@ -601,13 +1259,45 @@ void fn_rmr (inode_state& state, const wordvec& words){
           throw yshell_exn(error);
           return;
       }
+      //Only the current tree's own copies may be changed
       if ( target_head->is_dir() )
       {
-         postorder_traversal(target_head);
+         target_head = state.writable(target_head);
+         parent = parent->get_inode_nr() == target_head->get_inode_nr()
+                ? target_head : target_head->get_parent();
+      }
+      else
+      {
+         parent = state.writable(parent);
+      }
+      dentry_cache& dcache = state.get_dcache();
+      long removed = target_head->get_total_size();
+      if ( target_head->is_dir() )
+      {
+         dcache.forget_path(path_of(state, target_head));
+         postorder_traversal(state, target_head);
+         state.paths_changed();
+         target_head->adjust_total(-removed);
       }
       if ( parent->get_inode_nr() != target_head->get_inode_nr() )
       {
-         parent->delete_child(target_head->get_name());
+         string name = target_head->get_name();
+         if ( parent->delete_child(name) )
+         {
+            if ( target_head->is_file() )
+            {
+               parent->adjust_total(-removed);
+               state.get_index().remove(target_head);
+            }
+            dcache.forget(parent->get_inode_nr(), name);
+            state.get_names().remove(name, target_head->get_inode_nr());
+            if ( target_head->is_dir() )
+            {
+               dcache.forget(target_head->get_inode_nr(), ".");
+               dcache.forget(target_head->get_inode_nr(), "..");
+            }
+            dcache.forget_path(child_path(path_of(state, parent), name));
+         }
       }
    }
    if ( error.size() > 0 )
@@ -616,128 +1306,692 @@ void fn_rmr (inode_state& state, const wordvec& words){
    }
 }
 
+void fn_write (inode_state& state, const viewvec& words){
+   DEBUGF ('c', state);
+   DEBUGF ('c', words);
+
+   //Case: Bad arguments
+   if ( words.size() < 3 )
+   {
+      throw yshell_exn("write: Usage: write file offset [words...]");
+   }
+   size_t offset = 0;
+   for (char digit: words[2])
+   {
+      if ( not isdigit(digit) ||
+           offset > (SIZE_MAX - (digit - '0')) / 10 )
+      {
+         throw yshell_exn("write: " + words[2] + ": Invalid offset");
+      }
+      offset = offset * 10 + (digit - '0');
+   }
+   //Checked before go_to_file copies a file a snapshot shares, so
+   //that a write that fails changes nothing
+   inode_ptr found = go_to_path(state, words, 1, 0);
+   if ( found != nullptr && found->is_file() &&
+        offset > found->get_plain_contents()->word_count() )
+   {
+      throw yshell_exn("write: " + words[2] + ": Past the end of " +
+                       words[1]);
+   }
+   inode_ptr parent;
+   inode_ptr file = go_to_file(state, words, 1, parent);
+   plain_file_ptr contents = file->get_plain_contents();
+   long before = contents->size();
+   contents->overwrite(offset, words.begin() + 3, words.end());
+   parent->adjust_total(long(contents->size()) - before);
+   state.get_index().rewrite(file, parent, words.begin() + 3,
+                             words.end());
+}
+
+void run_command (inode_state& state, command_fn fn,
+                  const viewvec& words){
+   static const unordered_set<string> exclusive {
+      "append", "compact", "cp", "import", "load", "mount", "mv",
+      "restore", "rm", "rmr", "save", "snapshot", "snapshots", "write",
+   };
+   if ( exclusive.count(words.at(0)) == 0 )
+   {
+      try
+      {
+         inode_state::tree_guard guard(state, false);
+         fn(state, words);
+         return;
+      }
+      catch (needs_exclusive&)
+      {
+         DEBUGF ('c', words.at(0) << " needs the tree exclusively");
+      }
+   }
+   inode_state::tree_guard guard(state, true);
+   fn(state, words);
+}
+
+//Private class: The output of a command in a pipeline or
+//redirected into a file.  What is written is split into words and
+//appended to a file not linked into the tree a block at a time, so
+//the output is never held whole as text.  A word cut off at the end
+//of a block is moved to the front and finished in the next one.
+class file_sink: public streambuf
+{
+   public:
+      file_sink(plain_file_ptr file);
+      void finish();
+   protected:
+      int_type overflow(int_type letter) override;
+   private:
+      static constexpr size_t BLOCK_BYTES = 65536;
+      plain_file_ptr file;
+      vector<char> block;
+      void drain(bool last);
+};
+
+file_sink::file_sink(plain_file_ptr file):
+   file(file), block(BLOCK_BYTES)
+{
+   setp(block.data(), block.data() + block.size());
+}
+
+void file_sink::finish()
+{
+   drain(true);
+}
+
+file_sink::int_type file_sink::overflow(int_type letter)
+{
+   drain(false);
+   if ( letter != traits_type::eof() )
+   {
+      *pptr() = traits_type::to_char_type(letter);
+      pbump(1);
+   }
+   return traits_type::not_eof(letter);
+}
+
+void file_sink::drain(bool last)
+{
+   static const char* const WHITESPACE = " \t\n\v\f\r";
+   static thread_local viewvec words;
+   size_t used = pptr() - pbase();
+   size_t done = used;
+   while ( not last && done > 0 &&
+           strchr(WHITESPACE, block[done - 1]) == nullptr )
+   {
+      --done;
+   }
+   split(strview(block.data(), done), WHITESPACE, words);
+   file->append(words.begin(), words.end());
+   //A word as long as the block makes the block bigger
+   size_t kept = used - done;
+   memmove(block.data(), block.data() + done, kept);
+   if ( kept == block.size() ) block.resize(block.size() * 2);
+   setp(block.data(), block.data() + block.size());
+   pbump(kept);
+}
+
+//Private function: Runs one command of a line with its output
+//going into a new file that is not linked into the tree, and
+//returns the file.
+inode_ptr run_into_file(inode_state& state, command_fn fn,
+                        const viewvec& words){
+   inode_ptr output = state.make_inode(PLAIN_INODE);
+   file_sink sink(output->get_plain_contents());
+   ostream stream(&sink);
+   ostream* before = state.redirect(&stream);
+   try
+   {
+      run_command(state, fn, words);
+   }
+   catch (...)
+   {
+      state.redirect(before);
+      throw;
+   }
+   state.redirect(before);
+   sink.finish();
+   return output;
+}
+
+//Private function: Puts a line's output into the file it was
+//redirected to, making the file if need be.  With > the file is
+//given the output's chunks in place of its own words, and with >>
+//the output's words are appended.
+void write_redirect(inode_state& state, const viewvec& words,
+                    bool appending, inode_ptr output){
+   inode_state::tree_guard guard(state, true);
+   int destination = words.size() - 1;
+   plain_file_ptr from = output->get_plain_contents();
+   inode_ptr file = go_to_path(state, words, destination, 0);
+   inode_ptr parent;
+   if ( file == nullptr )
+   {
+      parent = go_to_path(state, words, destination, 1);
+      strview dir, last;
+      split_last(words[destination], dir, last);
+      string name(last.str());
+      if ( parent == nullptr || not parent->is_dir() ||
+           name.empty() || name == "." || name == ".." )
+      {
+         throw yshell_exn(words[destination] +
+                          ": Invalid redirection");
+      }
+      parent = state.writable(parent);
+      file = state.make_inode(PLAIN_INODE);
+      file->set_name(name);
+      file->get_plain_contents()->copy_from(*from);
+      parent->add_file(name, file);
+      parent->adjust_total(file->get_total_size());
+      state.get_index().add(file, parent);
+      state.get_names().add(name, file, parent);
+      state.get_dcache().enter(parent, name, file);
+      return;
+   }
+   file = go_to_file(state, words, destination, parent);
+   plain_file_ptr contents = file->get_plain_contents();
+   long before = contents->size();
+   if ( appending )
+   {
+      static thread_local viewvec appended;
+      appended.clear();
+      from->view_words(appended);
+      contents->append(appended.begin(), appended.end());
+      state.get_index().extend(file, parent, appended.begin(),
+                               appended.end());
+   }
+   else
+   {
+      state.get_index().remove(file);
+      contents->copy_from(*from);
+      state.get_index().add(file, parent);
+   }
+   parent->adjust_total(long(contents->size()) - before);
+}
+
+void run_line (inode_state& state, commands& cmdmap,
+               const viewvec& words, run_hook hook){
+   auto is_special = [](strview word) {
+      return word == "|" || word == ">" || word == ">>";
+   };
+   //Case: No pipeline or redirection
+   if ( none_of(words.begin(), words.end(), is_special) )
+   {
+      run_command(state, cmdmap.at(words.at(0)), words);
+      return;
+   }
+   size_t end = words.size();
+   bool redirected = end >= 3 &&
+                     (words[end - 2] == ">" || words[end - 2] == ">>");
+   bool appending = redirected && words[end - 2] == ">>";
+   if ( redirected ) end -= 2;
+   //Find each command, and check them all before running any
+   vector<pair<size_t,size_t>> stages;
+   size_t first = 0;
+   for (size_t index = 0; index <= end; ++index)
+   {
+      if ( index < end && words[index] != "|" )
+      {
+         if ( words[index] == ">" || words[index] == ">>" )
+         {
+            throw yshell_exn(words[index] + ": Invalid redirection");
+         }
+         continue;
+      }
+      if ( index == first )
+      {
+         throw yshell_exn("|: Invalid null command");
+      }
+      cmdmap.at(words[first]);
+      stages.push_back({first, index});
+      first = index + 1;
+   }
+   //Each command is given the words the one before it wrote after
+   //its own
+   inode_ptr piped;
+   viewvec stage_words;
+   for (size_t stage = 0; stage < stages.size(); ++stage)
+   {
+      stage_words.assign(words.begin() + stages[stage].first,
+                         words.begin() + stages[stage].second);
+      if ( piped != nullptr )
+      {
+         piped->get_plain_contents()->view_words(stage_words);
+      }
+      command_fn fn = cmdmap.at(stage_words[0]);
+      if ( hook != nullptr ) hook(stage_words);
+      if ( stage + 1 == stages.size() && not redirected )
+      {
+         run_command(state, fn, stage_words);
+         return;
+      }
+      piped = run_into_file(state, fn, stage_words);
+   }
+   if ( hook != nullptr )
+   {
+      viewvec output {words[end], words[end + 1]};
+      piped->get_plain_contents()->view_words(output);
+      hook(output);
+   }
+   write_redirect(state, words, appending, piped);
+}
+
+void write_output (inode_state& state, strview path, bool appending,
+                   viewvec_itor begin, viewvec_itor end){
+   inode_ptr output = state.make_inode(PLAIN_INODE);
+   output->get_plain_contents()->append(begin, end);
+   write_redirect(state, viewvec {path}, appending, output);
+}
+
 int exit_status_message() {
    int exit_status = exit_status::get();
    cout << execname() << ": exit(" << exit_status << ")" << endl;
    return exit_status;
 }
 
-//Private function: Gets the designated path
-inode_ptr go_to_path(inode_state& state, const wordvec &words,
+//Private function: Gets the designated path.
+//Absolute paths are looked up whole in the dentry cache, and
+//every component walked is looked up there before the directory.
+//The components are views into the word, and the absolute path is
+//built in a buffer each thread keeps, so a lookup that hits the
+//cache allocates nothing.
+inode_ptr go_to_path(inode_state& state, const viewvec &words,
                      int destination, int control){
-   bool start_at_root = false;
-   wordvec path = split(words[destination],"/");
-   
-   //Determine whether to start at the root
-   if (words[destination].at(0)=='/')
+   strview pathname = words[destination];
+   dentry_cache& dcache = state.get_dcache();
+   strview walked = pathname;
+   if ( control == 1 )
    {
-      start_at_root = true;
+      strview last;
+      split_last(pathname, walked, last);
    }
    
-   //Begin traversal
-   inode_ptr head;
-   if ( start_at_root == true )
+   //Determine whether to start at the root.  Only absolute paths
+   //without . or .. have a unique name in the path cache.
+   bool start_at_root = pathname.at(0) == '/';
+   static thread_local string abspath;
+   abspath.clear();
+   strview name;
+   if ( start_at_root )
    {
-      head = state.getroot();
-   } 
-   else
-   {
-      head = state.getcwd();
+      abspath = "/";
+      tokenizer path(walked, "/");
+      while ( path.next(name) )
+      {
+         if ( name == "." || name == ".." )
+         {
+            abspath.clear();
+            break;
+         }
+         if ( abspath.size() > 1 ) abspath += '/';
+         abspath.append(name.data(), name.size());
+      }
+      if ( not abspath.empty() )
+      {
+         inode_ptr hit = dcache.lookup_path(abspath);
+         if ( hit != nullptr ) return hit;
+      }
    }
    
+   //Begin traversal
+   inode_ptr head = start_at_root ? state.getroot() : state.getcwd();
+   
    //For every inode in tree, go to..
-   int size = path.size()-control;
-   for ( int i = 0; i < size; ++i )
+   tokenizer path(walked, "/");
+   while ( path.next(name) )
    {
-      if ( head->is_dir() )
-      {
-         head = head->get_child_dir(path[i]);
-      } 
-      else
+      if ( not head->is_dir() )
       {
-        head = nullptr;
+        return nullptr;
       }
-      if ( head == nullptr ) 
+      inode_ptr child = dcache.lookup(head, name);
+      if ( child == nullptr )
       {
-        return nullptr;
+         child = head->get_child_dir(name);
+         if ( child == nullptr ) 
+         {
+           return nullptr;
+         }
+         dcache.enter(head, name, child);
       }
+      head = child;
+   }
+   if ( not abspath.empty() )
+   {
+      dcache.enter_path(abspath, head);
    }
    return head;
 }
 
-//Private function: Performs the printing lsr function
-void preorder_traversal(inode_ptr curr_inode, string path){
-   const string name = curr_inode->get_name();
-   path += curr_inode->get_name();
-   
-   cout << path << ":" << endl;
-   inode_ptr currDir = curr_inode;
-   directory_ptr the_contents = directory_ptr_of(
-                                currDir->get_contents());
-   map<string, inode_ptr>::iterator itor1 = 
-                                the_contents->get_dirents()->begin();
-   map<string, inode_ptr>::const_iterator end1 = 
-                                the_contents->get_dirents()->end();
-   // Iterate through the map and print..
-   for (; itor1 != end1; ++itor1)
+//Private function: Splits a pathname into the views of its last
+//component and of everything before it.  Slashes at the end are
+//skipped, as split skips them.
+void split_last(strview pathname, strview& dir, strview& last){
+   size_t end = pathname.size();
+   while ( end > 0 && pathname[end - 1] == '/' ) --end;
+   size_t start = end;
+   while ( start > 0 && pathname[start - 1] != '/' ) --start;
+   dir = strview(pathname.data(), start);
+   last = strview(pathname.data() + start, end - start);
+}
+
+//Private function: Finds the directory mv or cp puts something
+//into, and the name it goes under:  the target itself and the
+//source's name if the target is a directory, or else the directory
+//before the target and its last component.  Returns nullptr if
+//there is no such directory.
+inode_ptr go_to_target(inode_state& state, const viewvec& words,
+                       int destination, strview source_name,
+                       string& name){
+   inode_ptr target = go_to_path(state, words, destination, 0);
+   if ( target != nullptr && target->is_dir() )
+   {
+      name = source_name.str();
+      return target;
+   }
+   strview dir, last;
+   split_last(words[destination], dir, last);
+   name = last.str();
+   target = go_to_path(state, words, destination, 1);
+   if ( target == nullptr || not target->is_dir() )
+   {
+      return nullptr;
+   }
+   return target;
+}
+
+//Private function: Finds a file about to be changed in place, and
+//the directory it is in, both the current tree's own.  A file a
+//snapshot or a copy still shares is copied first, as writable
+//copies a directory.
+inode_ptr go_to_file(inode_state& state, const viewvec& words,
+                     int destination, inode_ptr& parent){
+   inode_ptr file = go_to_path(state, words, destination, 0);
+   if ( file == nullptr )
+   {
+      throw yshell_exn(words[0] + ": " + words[destination] +
+                       ": No such file or directory");
+   }
+   if ( file->is_dir() )
+   {
+      throw yshell_exn(words[0] + ": " + words[destination] +
+                       ": Is a directory");
+   }
+   parent = state.writable(go_to_path(state, words, destination, 1));
+   inode_ptr copy = state.renamable(file);
+   if ( copy != file )
+   {
+      const string& name = copy->get_name();
+      parent->get_directory_contents()->replace(name, copy);
+      dentry_cache& dcache = state.get_dcache();
+      dcache.forget(parent->get_inode_nr(), name);
+      dcache.forget_path(child_path(path_of(state, parent), name));
+      state.get_names().add(name, copy, parent);
+      state.get_index().relink(copy, parent);
+   }
+   return copy;
+}
+
+//Private function: Whether a directory is dir itself or anywhere
+//below it, found by walking its .. links up to the root.
+bool is_below(inode_ptr node, inode_ptr dir){
+   while ( node != nullptr )
+   {
+      if ( node->get_inode_nr() == dir->get_inode_nr() )
+      {
+         return true;
+      }
+      inode_ptr parent = node->get_parent();
+      if ( parent == node )
+      {
+         break;
+      }
+      node = parent;
+   }
+   return false;
+}
+
+//Private function: The absolute path of a directory.  See
+//inode_state::get_path.
+string path_of(inode_state& state, inode_ptr dir){
+   return state.get_path(dir);
+}
+
+//Private function: Appends a name to a directory's path
+string child_path(const string& parent_path, const string& name){
+   if ( parent_path.compare("/") == 0 )
+   {
+      return parent_path + name;
+   }
+   return parent_path + "/" + name;
+}
+
+//Private function: Prints one line per dirent, for ls and lsr
+void print_dirents(ostream& out, directory_ptr the_contents){
+   directory::const_iterator itor = the_contents->begin();
+   const directory::const_iterator end = the_contents->end();
+   // Iterate through the dirents in name order and print..
+   for (; itor != end; ++itor)
    {
     //Inode number
-    cout << itor1->second->get_inode_nr() << "  " ;
+    out << itor->second->get_inode_nr() << "  " ;
 
     //Size
-    if(itor1->second->is_dir())
+    if(itor->second->is_dir())
     {
-        cout << itor1->second->get_directory_contents()->
+        out << itor->second->get_directory_contents()->
                                      size() << "  " ;
     }
     else
     {
-    cout << itor1->second->get_plain_contents()->
+    out << itor->second->get_plain_contents()->
                                  size() << "  ";
     }
-    //Name
-    if(itor1->second->is_dir() && 
-    (itor1->first.compare(".") != 0) && 
-    (itor1->first.compare("..") != 0) )
-    cout << itor1->first << "/" <<endl;
+    //Name, with a "/" next to a directory
+    if(itor->second->is_dir() && 
+    (itor->first.compare(".") != 0) && 
+    (itor->first.compare("..") != 0) )
+    out << itor->first << "/" <<endl;
     else
-    cout << itor1->first << endl;
+    out << itor->first << endl;
    }
+}
+
+//Private function: Performs the printing lsr function.
+//Walks with an explicit stack rather than recursion, so that the
+//depth of the tree is not limited by the depth of the C++ stack,
+//and builds every header in one path buffer, which starts out as
+//the absolute path of the top directory.
+void preorder_traversal(inode_state& state, inode_ptr head){
+   ostream& out = state.out();
+   string path = path_of(state, head);
+   if ( work_pool::size() > 1 )
+   {
+      parallel_preorder_traversal(out, head, path);
+      return;
+   }
+   //Each pending directory remembers how much of the path buffer
+   //belongs to its parent.
+   struct pending {
+      inode_ptr dir;
+      size_t parent_length;
+   };
+   vector<pending> stack {{head, path.size()}};
+   while ( not stack.empty() )
+   {
+      pending next = stack.back();
+      stack.pop_back();
+      path.resize(next.parent_length);
+      if ( next.dir != head )
+         path += next.dir->get_name();
+      
+      out << path << ":" << endl;
+      directory_ptr directory = next.dir->get_directory_contents();
+      directory::read_guard guard(*directory);
+      print_dirents(out, directory);
+      
+      //Push the subdirectories, then reverse them so that they
+      //come off the stack in name order.
+      if ( path.compare("/") != 0 )
+         path += "/";
+      size_t first = stack.size();
+      directory::const_iterator itor = directory->begin();
+      const directory::const_iterator end = directory->end();
+      for (; itor != end; ++itor) 
+      {
+         if ( itor->second->is_dir() && itor->first.compare(".") != 0
+              && itor->first.compare("..") != 0 )
+         {
+            stack.push_back({itor->second, path.size()});
+         }
+      }
+      reverse(stack.begin() + first, stack.end());
+   }
+}
+
+//Private function: The parallel lsr.  Each directory is listed
+//into its own buffer by a task on the work pool, which spawns one
+//task per subdirectory.  The buffers hang off one another in the
+//same shape as the tree, and are written out in preorder once
+//every task has finished, so the output is the same as the
+//sequential walk.
+struct listing {
+   string text;
+   vector<unique_ptr<listing>> children;
+};
+
+void list_directory(inode_ptr dir, string path, listing* result){
+   ostringstream text;
+   text << path << ":" << endl;
+   directory_ptr directory = dir->get_directory_contents();
+   directory::read_guard guard(*directory);
+   print_dirents(text, directory);
+   result->text = text.str();
    
-   //Start another iteration, this time for traversal
-   directory_ptr directory = curr_inode->get_directory_contents();
-   map<string, inode_ptr>::const_iterator itor = 
-                           directory->get_dirents()->begin();
-   ++itor; ++itor;
-   map<string, inode_ptr>::const_iterator end = 
-                           directory->get_dirents()->end();
    if ( path.compare("/") != 0 )
       path += "/";
-   //Recursive traversal loop
+   directory::const_iterator itor = directory->begin();
+   const directory::const_iterator end = directory->end();
    for (; itor != end; ++itor) 
    {
-      if ( itor->second->is_dir() )
+      if ( itor->second->is_dir() && itor->first.compare(".") != 0
+           && itor->first.compare("..") != 0 )
       {
-         preorder_traversal(itor->second, path);
+         result->children.emplace_back(new listing());
+         listing* slot = result->children.back().get();
+         inode_ptr child = itor->second;
+         string below = path + itor->first;
+         work_pool::spawn([child, below, slot]() {
+            list_directory(child, below, slot);
+         });
       }
    }
 }
 
-void postorder_traversal(inode_ptr curr_inode){
-   //Iteration for traversal
-   directory_ptr directory = curr_inode->get_directory_contents();
-   map<string, inode_ptr>::iterator itor = 
-                           directory->get_dirents()->begin();
-   ++itor; ++itor;
-   map<string, inode_ptr>::const_iterator end = 
-                           directory->get_dirents()->end();
-   //Recursive removal loop
-   for (; itor != end;) {
-      if ( itor->second->is_dir() )
-         postorder_traversal(itor->second);
-      directory->get_dirents()->erase(itor++);
+void parallel_preorder_traversal(ostream& out, inode_ptr head,
+                                 const string& head_path){
+   listing top;
+   work_pool::run([head, &head_path, &top]() {
+      list_directory(head, head_path, &top);
+   });
+   vector<const listing*> stack {&top};
+   while ( not stack.empty() )
+   {
+      const listing* next = stack.back();
+      stack.pop_back();
+      out.write(next->text.data(), next->text.size());
+      for (auto child = next->children.rbegin();
+           child != next->children.rend(); ++child)
+      {
+         stack.push_back(child->get());
+      }
    }
- }
+   out.flush();
+}
+
+//Private function: Empties a directory for rmr, children first.
+//Each frame on the explicit stack is a directory part way through
+//its dirents.  A directory is emptied only after all of its
+//subdirectories, so freeing it never recurses.  Not run on the
+//work pool; see workpool.h.
+void postorder_traversal(inode_state& state, inode_ptr head){
+   struct frame {
+      inode_ptr dir;
+      directory_ptr contents;
+      directory::const_iterator next;
+   };
+   dentry_cache& dcache = state.get_dcache();
+   directory_ptr head_contents = head->get_directory_contents();
+   vector<frame> stack {{head, head_contents, head_contents->begin()}};
+   while ( not stack.empty() )
+   {
+      frame& top = stack.back();
+      if ( top.next == top.contents->end() )
+      {
+         //Then drop every child at once
+         top.contents->erase_children();
+         stack.pop_back();
+         continue;
+      }
+      directory::const_iterator::dirent entry = *top.next;
+      ++top.next;
+      if ( entry.first.compare(".") == 0 || 
+           entry.first.compare("..") == 0 )
+      {
+         continue;
+      }
+      dcache.forget(top.dir->get_inode_nr(), entry.first);
+      state.get_names().remove(entry.first,
+                               entry.second->get_inode_nr());
+      if ( entry.second->is_file() )
+      {
+         state.get_index().remove(entry.second);
+      }
+      //A frozen directory is still part of a snapshot, so it is only
+      //unlinked, not emptied, but what is below it leaves the
+      //indexes
+      else if ( state.is_frozen(entry.second) )
+      {
+         unindex_subtree(state, entry.second);
+      }
+      else
+      {
+         dcache.forget(entry.second->get_inode_nr(), ".");
+         dcache.forget(entry.second->get_inode_nr(), "..");
+         directory_ptr contents = entry.second->get_directory_contents();
+         stack.push_back({entry.second, contents, contents->begin()});
+      }
+   }
+}
+
+//Private function: Drops everything below a directory from the
+//name and word indexes, without changing the directory.  A
+//directory never looked into has nothing in the indexes.
+void unindex_subtree(inode_state& state, inode_ptr head){
+   word_index& index = state.get_index();
+   name_index& names = state.get_names();
+   if ( index.is_stale() && names.is_stale() ) return;
+   vector<inode_ptr> stack {head};
+   while ( not stack.empty() )
+   {
+      directory_ptr contents = stack.back()->get_directory_contents();
+      stack.pop_back();
+      if ( not contents->is_loaded() ) continue;
+      for (directory::const_iterator itor = contents->begin();
+           itor != contents->end(); ++itor)
+      {
+         if ( itor->first.compare(".") == 0 ||
+              itor->first.compare("..") == 0 ) continue;
+         names.remove(itor->first, itor->second->get_inode_nr());
+         if ( itor->second->is_dir() )
+         {
+            stack.push_back(itor->second);
+         }
+         else
+         {
+            index.remove(itor->second);
+         }
+      }
+   }
+}
 
 //Private function: Just a helper function
 string wordvec_to_string(wordvec &words){
@@ -3,6 +3,7 @@
 #ifndef __COMMANDS_H__
 #define __COMMANDS_H__
 
+#include <functional>
 #include <map>
 using namespace std;
 
@@ -13,8 +14,9 @@ using namespace std;
 // A couple of convenient usings to avoid verbosity.
 //
 
-using command_fn = void (*)(inode_state& state, const wordvec& words);
-using command_map = map<string,command_fn>;
+using command_fn = void (*)(inode_state& state, const viewvec& words);
+using command_map = map<strview,command_fn>;
+using run_hook = function<void (const viewvec& run)>;
 
 //
 // commands -
@@ -22,9 +24,11 @@ using command_map = map<string,command_fn>;
 //    Each command "foo" is interpreted by a command_fn fn_foo.
 // ctor -
 //    The default ctor initializes the map.
-// operator[] -
-//    Given a string, returns a command_fn associated with it,
-//    or 0 if not found.
+// at -
+//    Given a command name, returns the command_fn associated with
+//    it, or throws a yshell_exn if there is none.  The words each
+//    command_fn is given are views of the line read, which the
+//    caller keeps until the command is done.
 //
 
 class commands {
@@ -34,7 +38,7 @@ class commands {
       command_map map;
    public:
       commands();
-      command_fn at (const string& cmd);
+      command_fn at (strview cmd);
 };
 
 
@@ -43,18 +47,81 @@ class commands {
 //    See the man page for a description of each of these functions.
 //
 
-void fn_cat    (inode_state& state, const wordvec& words);
-void fn_cd     (inode_state& state, const wordvec& words);
-void fn_echo   (inode_state& state, const wordvec& words);
-void fn_exit   (inode_state& state, const wordvec& words);
-void fn_ls     (inode_state& state, const wordvec& words);
-void fn_lsr    (inode_state& state, const wordvec& words);
-void fn_make   (inode_state& state, const wordvec& words);
-void fn_mkdir  (inode_state& state, const wordvec& words);
-void fn_prompt (inode_state& state, const wordvec& words);
-void fn_pwd    (inode_state& state, const wordvec& words);
-void fn_rm     (inode_state& state, const wordvec& words);
-void fn_rmr    (inode_state& state, const wordvec& words);
+void fn_append (inode_state& state, const viewvec& words);
+void fn_cat    (inode_state& state, const viewvec& words);
+void fn_cd     (inode_state& state, const viewvec& words);
+void fn_compact(inode_state& state, const viewvec& words);
+void fn_cp     (inode_state& state, const viewvec& words);
+void fn_du     (inode_state& state, const viewvec& words);
+void fn_echo   (inode_state& state, const viewvec& words);
+void fn_exit   (inode_state& state, const viewvec& words);
+void fn_find   (inode_state& state, const viewvec& words);
+void fn_grep   (inode_state& state, const viewvec& words);
+void fn_import (inode_state& state, const viewvec& words);
+void fn_load   (inode_state& state, const viewvec& words);
+void fn_ls     (inode_state& state, const viewvec& words);
+void fn_lsr    (inode_state& state, const viewvec& words);
+void fn_make   (inode_state& state, const viewvec& words);
+void fn_mem    (inode_state& state, const viewvec& words);
+void fn_mkdir  (inode_state& state, const viewvec& words);
+void fn_mount  (inode_state& state, const viewvec& words);
+void fn_mv     (inode_state& state, const viewvec& words);
+void fn_prompt (inode_state& state, const viewvec& words);
+void fn_pwd    (inode_state& state, const viewvec& words);
+void fn_restore(inode_state& state, const viewvec& words);
+void fn_rm     (inode_state& state, const viewvec& words);
+void fn_rmr    (inode_state& state, const viewvec& words);
+void fn_save   (inode_state& state, const viewvec& words);
+void fn_snapshot (inode_state& state, const viewvec& words);
+void fn_snapshots (inode_state& state, const viewvec& words);
+void fn_stat   (inode_state& state, const viewvec& words);
+void fn_stats  (inode_state& state, const viewvec& words);
+void fn_write  (inode_state& state, const viewvec& words);
+
+//
+// run_command -
+//    Runs a command's function holding the tree as it needs:  rm,
+//    rmr, mv, cp, append, write and the commands that save, load,
+//    import, mount, compact or snapshot the whole tree hold it
+//    exclusively, and every other command holds it shared.
+//    A command that finds it has to copy frozen directories is run
+//    again holding the tree exclusively.
+//
+// run_line -
+//    Runs the commands in a line split into words.  Commands
+//    separated by a "|" word are run in turn, each given the words
+//    written by the one before after its own.  A line ending with
+//    "> file" puts what the last command writes into file in place
+//    of its words, making it if need be, and ">> file" appends to
+//    it.  The output is split into words as it is written, so
+//    neither is ever held whole as text, and the file is changed
+//    once the last command has finished.  Throws a yshell_exn if a
+//    command is not known, before any is run.  If a hook is given,
+//    it is called before each command runs with the words it is
+//    given, and before the file is changed with ">" or ">>", the
+//    file and the words about to be put into it, so that the
+//    journal records what was run and not the line.
+//
+// write_output -
+//    Puts words into the file at path, as a line redirected into it
+//    with ">>", if appending, or ">" would.  Replays a redirection
+//    from the journal.
+//
+
+void run_command (inode_state& state, command_fn fn,
+                  const viewvec& words);
+void run_line (inode_state& state, commands& cmdmap,
+               const viewvec& words, run_hook hook = nullptr);
+void write_output (inode_state& state, strview path, bool appending,
+                   viewvec_itor begin, viewvec_itor end);
+
+//
+// path_of -
+//    The absolute path of a directory, found by walking its ".."
+//    links up to the root.  See inode_state::get_path.
+//
+
+string path_of (inode_state& state, inode_ptr dir);
 
 //
 // exit_status_message -
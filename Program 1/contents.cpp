@@ -0,0 +1,181 @@
+// $Id: contents.cpp,v 1.1 2015-02-04 13:52:10-08 - - $
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+#include "contents.h"
+#include "debug.h"
+
+file_payload::file_payload (content_store* store, slab_arena* arena,
+                            const string& text,
+                            const vector<uint32_t>& starts,
+                            uint64_t hash):
+   text (text.begin(), text.end(), arena_allocator<char> (arena)),
+   starts (starts.begin(), starts.end(),
+           arena_allocator<uint32_t> (arena)),
+   hash (hash), store (store) {
+}
+
+file_payload::file_payload (slab_arena* arena,
+                            const file_payload& that):
+   text (that.text.begin(), that.text.end(),
+         arena_allocator<char> (arena)),
+   starts (that.starts.begin(), that.starts.end(),
+           arena_allocator<uint32_t> (arena)),
+   hash (that.hash), store (that.store) {
+}
+
+file_payload::~file_payload() {
+   store->forget (this);
+}
+
+bool file_payload::same_text (const string& that) const {
+   return text.size() == that.size()
+      and equal (text.begin(), text.end(), that.begin());
+}
+
+strview file_payload::word (size_t index) const {
+   size_t end = index + 1 < starts.size()
+              ? starts[index + 1] - 1 : text.size();
+   return strview (text.data() + starts[index], end - starts[index]);
+}
+
+wordvec file_payload::read() const {
+   wordvec result;
+   result.reserve (starts.size());
+   for (size_t index = 0; index < starts.size(); ++index) {
+      result.push_back (word (index).str());
+   }
+   return result;
+}
+
+void file_payload::write (ostream& out) const {
+   out.write (text.data(), text.size());
+}
+
+content_store::content_store (slab_arena* arena): arena (arena) {
+}
+
+uint64_t content_store::hash_of (const string& text) {
+   uint64_t hash = 14695981039346656037ULL;
+   for (char byte: text) {
+      hash = (hash ^ static_cast<unsigned char> (byte))
+           * 1099511628211ULL;
+   }
+   return hash;
+}
+
+payload_ptr content_store::intern (viewvec_itor begin,
+                                   viewvec_itor end) {
+   // The text is put together in a buffer each thread keeps, and
+   // only copied into the arena if no file has it yet.
+   static thread_local string text;
+   static thread_local vector<uint32_t> starts;
+   text.clear();
+   starts.clear();
+   size_t length = 0;
+   for (viewvec_itor itor = begin; itor != end; ++itor) {
+      length += itor->size() + 1;
+   }
+   if (length > UINT32_MAX) {
+      throw yshell_exn ("file too large: " + to_string (length));
+   }
+   text.reserve (length);
+   starts.reserve (end - begin);
+   for (viewvec_itor itor = begin; itor != end; ++itor) {
+      if (itor != begin) text += ' ';
+      starts.push_back (text.size());
+      text.append (itor->data(), itor->size());
+   }
+   uint64_t hash = hash_of (text);
+   // Payloads looked at and not used go after the lock is released,
+   // since freeing the last reference to one takes the lock.
+   vector<payload_ptr> passed;
+   {
+      lock_guard<mutex> guard (lock);
+      auto range = payloads.equal_range (hash);
+      for (auto itor = range.first; itor != range.second; ++itor) {
+         payload_ptr found = itor->second.handle.lock();
+         if (found == nullptr) continue;
+         if (found->same_text (text)) {
+            DEBUGF ('s', "shared " << hash);
+            return found;
+         }
+         passed.push_back (found);
+      }
+   }
+   payload_ptr made = allocate_shared<file_payload> (
+                      arena_allocator<file_payload> (arena),
+                      this, arena, text, starts, hash);
+   lock_guard<mutex> guard (lock);
+   payloads.insert ({hash, {made.get(), made}});
+   stored_bytes += made->footprint();
+   DEBUGF ('s', "stored " << hash << ", " << made->footprint()
+          << " bytes");
+   return made;
+}
+
+payload_ptr content_store::relocate (const payload_ptr& payload) {
+   vector<payload_ptr> passed;
+   lock_guard<mutex> guard (lock);
+   auto range = payloads.equal_range (payload->hash);
+   for (auto itor = range.first; itor != range.second; ++itor) {
+      if (itor->second.payload != payload.get()) continue;
+      payload_ptr moved = allocate_shared<file_payload> (
+                          arena_allocator<file_payload> (arena),
+                          arena, *payload);
+      // The old one is no longer in the store, and is not counted
+      // as stored when it goes.
+      itor->second = {moved.get(), moved};
+      stored_bytes += moved->footprint();
+      stored_bytes -= payload->footprint();
+      return moved;
+   }
+   for (auto itor = range.first; itor != range.second; ++itor) {
+      payload_ptr found = itor->second.handle.lock();
+      if (found == nullptr) continue;
+      if (found->text == payload->text) return found;
+      passed.push_back (found);
+   }
+   return payload;
+}
+
+void content_store::forget (const file_payload* payload) {
+   lock_guard<mutex> guard (lock);
+   auto range = payloads.equal_range (payload->hash);
+   for (auto itor = range.first; itor != range.second; ++itor) {
+      if (itor->second.payload == payload) {
+         payloads.erase (itor);
+         stored_bytes -= payload->footprint();
+         return;
+      }
+   }
+}
+
+void content_store::attach (const payload_ptr& payload) {
+   lock_guard<mutex> guard (lock);
+   logical_bytes += payload->footprint();
+}
+
+void content_store::detach (const payload_ptr& payload) {
+   lock_guard<mutex> guard (lock);
+   logical_bytes -= payload->footprint();
+}
+
+void content_store::add_file() {
+   lock_guard<mutex> guard (lock);
+   ++files;
+}
+
+void content_store::remove_file() {
+   lock_guard<mutex> guard (lock);
+   --files;
+}
+
+content_store::stats content_store::get_stats() const {
+   lock_guard<mutex> guard (lock);
+   return {files, payloads.size(), logical_bytes, stored_bytes};
+}
+
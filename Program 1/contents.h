@@ -0,0 +1,132 @@
+// $Id: contents.h,v 1.1 2015-02-04 13:52:10-08 - - $
+
+#ifndef __CONTENTS_H__
+#define __CONTENTS_H__
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "arena.h"
+#include "util.h"
+
+class content_store;
+
+//
+// class file_payload -
+//    The words of a text file, kept in the arena as one buffer of
+//    the text as printed, with a single space between each word,
+//    and the offset in it where each word starts.  A payload never
+//    changes once it is made, so any number of files with the same
+//    words may share it.
+// read -
+//    Returns a copy of the words, as strings.
+// write -
+//    Writes the text to out in one write.
+// size -
+//    The number of characters when printed:  the lengths of the
+//    words plus a space between each.
+// word_count, word -
+//    The number of words, and a view of one of them in the buffer.
+// footprint -
+//    Roughly how many bytes of the arena the text and offsets take
+//    up.
+//
+
+class file_payload {
+   friend class content_store;
+   private:
+      vector<char,arena_allocator<char>> text;
+      vector<uint32_t,arena_allocator<uint32_t>> starts;
+      uint64_t hash;
+      content_store* store;
+      bool same_text (const string& that) const;
+   public:
+      file_payload (content_store* store, slab_arena* arena,
+                    const string& text,
+                    const vector<uint32_t>& starts, uint64_t hash);
+      file_payload (slab_arena* arena, const file_payload& that);
+      file_payload (const file_payload&) = delete;
+      file_payload& operator= (const file_payload&) = delete;
+      ~file_payload();
+      wordvec read() const;
+      void write (ostream& out) const;
+      size_t size() const { return text.size(); }
+      size_t word_count() const { return starts.size(); }
+      strview word (size_t index) const;
+      size_t footprint() const {
+         return text.capacity()
+              + starts.capacity() * sizeof (uint32_t);
+      }
+};
+
+using payload_ptr = shared_ptr<const file_payload>;
+
+//
+// class content_store -
+//    Every distinct file payload in the tree, keyed by a hash of its
+//    text (64-bit FNV-1a), so that files with the same words share
+//    one copy.  The store only keeps weak references:  a payload is
+//    dropped from it when the last file using it lets it go.  Since
+//    payloads never change, writing a shared file just points it at
+//    another payload, which is copy on write.  The store also counts
+//    the files and the payloads they use, for stats.
+// intern -
+//    Returns the payload holding the given words, making it if no
+//    file has them yet.
+// relocate -
+//    Returns a copy of a payload made in the arena now, which the
+//    store hands out in its place from then on, so that files are
+//    moved to it as they are compacted.  Files still holding the
+//    old one keep it until they let it go.  A payload moved already
+//    gives back its copy.
+// attach, detach -
+//    Called as a file starts and stops using a payload.
+// add_file, remove_file -
+//    Called as a file is made and freed.
+// get_stats -
+//    The number of files and payloads, and the arena bytes their
+//    words would take unshared and do take shared.
+//
+
+class content_store {
+   friend class file_payload;
+   public:
+      struct stats {
+         size_t files;
+         size_t payloads;
+         size_t logical_bytes;
+         size_t stored_bytes;
+      };
+   private:
+      struct stored {
+         const file_payload* payload;
+         weak_ptr<const file_payload> handle;
+      };
+      slab_arena* arena;
+      mutable mutex lock;
+      unordered_multimap<uint64_t,stored> payloads;
+      size_t stored_bytes {0};
+      size_t files {0};
+      size_t logical_bytes {0};
+      static uint64_t hash_of (const string& text);
+      void forget (const file_payload* payload);
+   public:
+      content_store (slab_arena* arena);
+      content_store (const content_store&) = delete;
+      content_store& operator= (const content_store&) = delete;
+      payload_ptr intern (viewvec_itor begin, viewvec_itor end);
+      payload_ptr relocate (const payload_ptr& payload);
+      void attach (const payload_ptr& payload);
+      void detach (const payload_ptr& payload);
+      void add_file();
+      void remove_file();
+      stats get_stats() const;
+};
+
+#endif
+
@@ -0,0 +1,110 @@
+// $Id: dcache.cpp,v 1.1 2015-01-09 11:20:41-08 - - $
+
+#include <functional>
+#include <iostream>
+
+using namespace std;
+
+#include "dcache.h"
+#include "debug.h"
+#include "inode.h"
+
+size_t dentry_cache::dentry_hash::operator() (const dentry_key& key)
+                                                               const {
+   return hash<symbol>() (key.name) * 31 + hash<int>() (key.dir_nr);
+}
+
+dentry_cache::shard& dentry_cache::shard_of (int dir_nr,
+                                             symbol name) {
+   return shards[dentry_hash() ({dir_nr, name}) % SHARDS];
+}
+
+const dentry_cache::shard& dentry_cache::shard_of (int dir_nr,
+                                             symbol name) const {
+   return shards[dentry_hash() ({dir_nr, name}) % SHARDS];
+}
+
+dentry_cache::shard& dentry_cache::shard_of (const string& abspath) {
+   return shards[hash<string>() (abspath) % SHARDS];
+}
+
+const dentry_cache::shard& dentry_cache::shard_of (
+                           const string& abspath) const {
+   return shards[hash<string>() (abspath) % SHARDS];
+}
+
+inode_ptr dentry_cache::lookup (const inode_ptr& dir,
+                                strview name) const {
+   symbol key = symbols::find (name);
+   if (key == symbols::NONE) return nullptr;
+   int dir_nr = dir->get_inode_nr();
+   const shard& part = shard_of (dir_nr, key);
+   lock_guard<mutex> guard (part.lock);
+   const auto itor = part.dentries.find ({dir_nr, key});
+   if (itor == part.dentries.end()) return nullptr;
+   // The same inode, unless one owns what the other does not.
+   const weak_ptr<inode>& made_for = itor->second.dir;
+   if (made_for.owner_before (dir) or dir.owner_before (made_for)) {
+      return nullptr;
+   }
+   DEBUGF ('d', "hit " << dir_nr << " " << name);
+   return itor->second.child;
+}
+
+void dentry_cache::enter (const inode_ptr& dir, strview name,
+                          inode_ptr child) {
+   symbol key = symbols::intern (name);
+   int dir_nr = dir->get_inode_nr();
+   shard& part = shard_of (dir_nr, key);
+   lock_guard<mutex> guard (part.lock);
+   part.dentries[{dir_nr, key}] = {dir, child};
+}
+
+void dentry_cache::forget (int dir_nr, strview name) {
+   symbol key = symbols::find (name);
+   if (key == symbols::NONE) return;
+   shard& part = shard_of (dir_nr, key);
+   lock_guard<mutex> guard (part.lock);
+   part.dentries.erase ({dir_nr, key});
+}
+
+inode_ptr dentry_cache::lookup_path (const string& abspath) const {
+   const shard& part = shard_of (abspath);
+   lock_guard<mutex> guard (part.lock);
+   const auto itor = part.paths.find (abspath);
+   if (itor == part.paths.end()) return nullptr;
+   DEBUGF ('d', "hit " << abspath);
+   return itor->second;
+}
+
+void dentry_cache::enter_path (const string& abspath,
+                               inode_ptr target) {
+   shard& part = shard_of (abspath);
+   lock_guard<mutex> guard (part.lock);
+   part.paths[abspath] = target;
+}
+
+void dentry_cache::forget_path (const string& abspath) {
+   // Paths below abspath hash anywhere, so every shard is trimmed.
+   // Every path below abspath sorts between abspath + "/" and
+   // abspath + "0", since '0' is the character right after '/'.
+   for (shard& part: shards) {
+      lock_guard<mutex> guard (part.lock);
+      if (abspath == "/") {
+         part.paths.clear();
+         continue;
+      }
+      part.paths.erase (abspath);
+      part.paths.erase (part.paths.lower_bound (abspath + "/"),
+                        part.paths.lower_bound (abspath + "0"));
+   }
+}
+
+void dentry_cache::clear() {
+   for (shard& part: shards) {
+      lock_guard<mutex> guard (part.lock);
+      part.dentries.clear();
+      part.paths.clear();
+   }
+}
+
@@ -0,0 +1,83 @@
+// $Id: dcache.h,v 1.1 2015-01-09 11:20:41-08 - - $
+
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+using namespace std;
+
+#include "symbols.h"
+#include "util.h"
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+//
+// class dentry_cache -
+//    Remembers the results of pathname lookups so that commands
+//    which refer to the same paths over and over do not rewalk the
+//    tree one component at a time.  Two tables are kept:  one keyed
+//    by (directory inode number, name symbol) for single components,
+//    and one keyed by normalized absolute pathname, each split
+//    into locked shards by hash.  A name is looked up as a view,
+//    and one never interned misses without taking a lock.  Inode
+//    numbers are given out again once free, so each binding also
+//    remembers which directory it was made for, and is a miss for
+//    any other with the same number.
+// lookup -
+//    Returns the cached child of a directory, or nullptr on a miss.
+// enter -
+//    Records a (directory, name) -> child binding.
+// forget -
+//    Drops a (directory, name) binding.  Must be called whenever a
+//    dirent is removed.
+// lookup_path, enter_path -
+//    Same as above, but for a whole absolute pathname.
+// forget_path -
+//    Drops the given absolute pathname and every pathname below it.
+//
+
+class dentry_cache {
+   private:
+      struct dentry_key {
+         int dir_nr;
+         symbol name;
+         bool operator== (const dentry_key& that) const {
+            return dir_nr == that.dir_nr and name == that.name;
+         }
+      };
+      struct dentry_hash {
+         size_t operator() (const dentry_key& key) const;
+      };
+      struct dentry {
+         weak_ptr<inode> dir;
+         inode_ptr child;
+      };
+      struct shard {
+         mutable mutex lock;
+         unordered_map<dentry_key,dentry,dentry_hash> dentries;
+         map<string,inode_ptr> paths;
+      };
+      static constexpr size_t SHARDS = 16;
+      shard shards[SHARDS];
+      shard& shard_of (int dir_nr, symbol name);
+      const shard& shard_of (int dir_nr, symbol name) const;
+      shard& shard_of (const string& abspath);
+      const shard& shard_of (const string& abspath) const;
+   public:
+      inode_ptr lookup (const inode_ptr& dir, strview name) const;
+      void enter (const inode_ptr& dir, strview name,
+                  inode_ptr child);
+      void forget (int dir_nr, strview name);
+      inode_ptr lookup_path (const string& abspath) const;
+      void enter_path (const string& abspath, inode_ptr target);
+      void forget_path (const string& abspath);
+      void clear();
+};
+
+#endif
+
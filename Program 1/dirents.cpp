@@ -0,0 +1,129 @@
+// $Id: dirents.cpp,v 1.1 2015-01-12 14:02:17-08 - - $
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+#include "debug.h"
+#include "dirents.h"
+
+static bool name_less (const dirent_table::dirent* left,
+                       const dirent_table::dirent* right) {
+   return symbols::name (left->first) < symbols::name (right->first);
+}
+
+//
+// An entry being sorted is kept with the first bytes of its name,
+// read as a big-endian number so that numbers compare as the names
+// do.  Most comparisons are settled by those, without going to the
+// name's string, which is somewhere else in memory.
+//
+struct keyed_dirent {
+   uint64_t prefix;
+   const dirent_table::dirent* entry;
+   keyed_dirent (const dirent_table::dirent* entry): entry (entry) {
+      const string& name = symbols::name (entry->first);
+      size_t length = min (name.size(), sizeof prefix);
+      prefix = 0;
+      for (size_t index = 0; index < sizeof prefix; ++index) {
+         unsigned char letter = index < length ? name[index] : 0;
+         prefix = prefix << 8 | letter;
+      }
+   }
+};
+
+static bool keyed_less (const keyed_dirent& left,
+                        const keyed_dirent& right) {
+   if (left.prefix != right.prefix) return left.prefix < right.prefix;
+   return name_less (left.entry, right.entry);
+}
+
+dirent_table::dirent_table (slab_arena* arena):
+   index (0, hash<symbol>(), equal_to<symbol>(),
+          arena_allocator<dirent> (arena)),
+   ordered (arena_allocator<const dirent*> (arena)) {
+}
+
+void dirent_table::sort_tail() const {
+   if (sorted == ordered.size()) return;
+   lock_guard<mutex> guard (sort_lock);
+   if (sorted == ordered.size()) return;
+   DEBUGF ('e', "merging " << ordered.size() - sorted << " into "
+          << sorted);
+   auto middle = ordered.begin() + sorted.load();
+   vector<keyed_dirent> keyed (middle, ordered.end());
+   sort (keyed.begin(), keyed.end(), keyed_less);
+   for (const keyed_dirent& each: keyed) *middle++ = each.entry;
+   middle = ordered.begin() + sorted.load();
+   inplace_merge (ordered.begin(), middle, ordered.end(), name_less);
+   sorted = ordered.size();
+}
+
+inode_ptr dirent_table::find (strview name) const {
+   symbol key = symbols::find (name);
+   if (key == symbols::NONE) return nullptr;
+   const auto itor = index.find (key);
+   if (itor == index.end()) return nullptr;
+   return itor->second;
+}
+
+bool dirent_table::insert (const string& name, inode_ptr node) {
+   return insert (symbols::intern (name), node);
+}
+
+bool dirent_table::insert (symbol name, inode_ptr node) {
+   auto result = index.insert (make_pair (name, node));
+   if (not result.second) return false;
+   ordered.push_back (&*result.first);
+   return true;
+}
+
+bool dirent_table::replace (const string& name, inode_ptr node) {
+   const auto itor = index.find (symbols::find (name));
+   if (itor == index.end()) return false;
+   itor->second = node;
+   return true;
+}
+
+bool dirent_table::erase (const string& name) {
+   const auto itor = index.find (symbols::find (name));
+   if (itor == index.end()) return false;
+   sort_tail();
+   auto where = lower_bound (ordered.begin(), ordered.end(),
+                             &*itor, name_less);
+   ordered.erase (where);
+   sorted = ordered.size();
+   index.erase (itor);
+   return true;
+}
+
+void dirent_table::clear() {
+   ordered.clear();
+   sorted = 0;
+   index.clear();
+}
+
+size_t dirent_table::footprint() const {
+   // Each hash node holds a next pointer and the dirent.  The names
+   // are in the symbol table.
+   size_t node = sizeof (void*) + sizeof (dirent);
+   return index.bucket_count() * sizeof (void*)
+        + index.size() * node
+        + ordered.capacity() * sizeof (const dirent*);
+}
+
+void dirent_table::reserve (size_t count) {
+   index.reserve (count);
+   ordered.reserve (count);
+}
+
+dirent_table::const_iterator dirent_table::begin() const {
+   sort_tail();
+   return const_iterator (ordered.begin());
+}
+
+dirent_table::const_iterator dirent_table::end() const {
+   return const_iterator (ordered.end());
+}
+
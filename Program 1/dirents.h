@@ -0,0 +1,103 @@
+// $Id: dirents.h,v 1.1 2015-01-12 14:02:17-08 - - $
+
+#ifndef __DIRENTS_H__
+#define __DIRENTS_H__
+
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "arena.h"
+#include "symbols.h"
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+//
+// class dirent_table -
+//    The entry container used by a directory.  Names are kept as
+//    symbols in a hashed index for lookups, and a compact array of
+//    pointers into that index is kept in name order for ls and lsr.
+//    A name that was never interned can not be in any table, so
+//    looking it up costs no more than the symbol table's miss.
+//    Names added since the last ordered walk sit unsorted at the
+//    end of the array and are merged in the next time the table is
+//    iterated, so that filling a large directory does not pay for a
+//    sorted insert each time.  Both structures live in the tree's
+//    arena.  Any number of readers may iterate at once:  the first
+//    to find an unsorted tail sorts it under a lock of its own.
+// find -
+//    Returns the inode bound to name, or nullptr.
+// insert -
+//    Binds name to node, unless name is already present.  The name
+//    may be given as a string or a symbol.
+// replace -
+//    Binds name to another node, keeping its place in the order.
+//    Returns false, changing nothing, if name is not present.
+// erase -
+//    Removes name, returning false if it was not present.
+// footprint -
+//    Roughly how many bytes of the arena the table takes up.
+// begin, end -
+//    Iterate over the entries in name order.  Any insert or erase
+//    invalidates the iterators.
+//
+
+class dirent_table {
+   public:
+      using dirent = pair<const symbol,inode_ptr>;
+      class const_iterator;
+   private:
+      using dirent_index = unordered_map<symbol,inode_ptr,hash<symbol>,
+                           equal_to<symbol>,arena_allocator<dirent>>;
+      using dirent_order = vector<const dirent*,
+                                  arena_allocator<const dirent*>>;
+      dirent_index index;
+      mutable dirent_order ordered;
+      mutable atomic<size_t> sorted {0};
+      mutable mutex sort_lock;
+      void sort_tail() const;
+   public:
+      dirent_table (slab_arena* arena);
+      size_t size() const { return index.size(); }
+      inode_ptr find (strview name) const;
+      bool insert (const string& name, inode_ptr node);
+      bool insert (symbol name, inode_ptr node);
+      bool replace (const string& name, inode_ptr node);
+      bool erase (const string& name);
+      size_t footprint() const;
+      void clear();
+      void reserve (size_t count);
+      const_iterator begin() const;
+      const_iterator end() const;
+};
+
+class dirent_table::const_iterator:
+      public iterator<forward_iterator_tag,const dirent> {
+   friend class dirent_table;
+   private:
+      dirent_order::const_iterator where;
+      const_iterator (dirent_order::const_iterator where):
+                      where (where) {}
+   public:
+      const dirent& operator*() const { return **where; }
+      const dirent* operator->() const { return *where; }
+      const_iterator& operator++() { ++where; return *this; }
+      const_iterator operator++ (int) {
+         const_iterator tmp (*this); ++where; return tmp;
+      }
+      bool operator== (const const_iterator& that) const {
+         return where == that.where;
+      }
+      bool operator!= (const const_iterator& that) const {
+         return where != that.where;
+      }
+};
+
+#endif
+
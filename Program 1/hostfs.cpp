@@ -0,0 +1,414 @@
+// $Id: hostfs.cpp,v 1.1 2015-02-16 11:40:22-08 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "hostfs.h"
+#include "workpool.h"
+
+static const char WHITESPACE[] {" \t\n\v\f\r"};
+
+// Files are read by tasks of this many, so that one big directory
+// is still spread over the pool.
+static const size_t FILES_PER_TASK {64};
+
+//
+// kept_type -
+//    DT_DIR or DT_REG for a host entry that a tree read from the
+//    host keeps, or else DT_UNKNOWN, with why set if the entry was
+//    left out rather than passed over.
+//
+
+static unsigned char kept_type (const struct dirent* entry,
+                                const string& path, const char*& why) {
+   why = nullptr;
+   unsigned char type = entry->d_type;
+   if (type == DT_UNKNOWN) {
+      struct stat status;
+      if (lstat (path.c_str(), &status) < 0) {
+         why = strerror (errno);
+         return DT_UNKNOWN;
+      }
+      type = S_ISDIR (status.st_mode) ? DT_DIR
+           : S_ISREG (status.st_mode) ? DT_REG : DT_UNKNOWN;
+   }
+   if (type != DT_DIR and type != DT_REG) return DT_UNKNOWN;
+   if (strpbrk (entry->d_name, WHITESPACE) != nullptr) {
+      why = "white space in name";
+      return DT_UNKNOWN;
+   }
+   return type;
+}
+
+static bool is_dot (const char* name) {
+   return strcmp (name, ".") == 0 or strcmp (name, "..") == 0;
+}
+
+//
+// import_job -
+//    What every task of one import shares:  the tree the inodes are
+//    made in, and what was left out.  Only the first thing left out
+//    is described, with a count of the rest.
+//
+
+class import_job {
+   private:
+      mutex lock;
+      string first_skipped;
+      size_t skip_count {0};
+   public:
+      inode_state& state;
+      import_job (inode_state& state): state (state) {}
+      void skip (const string& path, const char* why);
+      string skipped();
+};
+
+void import_job::skip (const string& path, const char* why) {
+   DEBUGF ('h', path << ": " << why);
+   lock_guard<mutex> guard (lock);
+   if (skip_count == 0) first_skipped = path + ": " + why;
+   ++skip_count;
+}
+
+string import_job::skipped() {
+   lock_guard<mutex> guard (lock);
+   if (skip_count <= 1) return first_skipped;
+   return first_skipped + " (and " + to_string (skip_count - 1)
+        + " more left out)";
+}
+
+//
+// read_host_file -
+//    Reads a whole host file into text, which is reused from one
+//    file to the next.  Returns false, with errno set, if it can
+//    not be read.
+//
+
+static bool read_host_file (const string& path, string& text) {
+   int fd = open (path.c_str(), O_RDONLY);
+   if (fd < 0) return false;
+   struct stat status;
+   if (fstat (fd, &status) < 0) {
+      int error = errno;
+      close (fd);
+      errno = error;
+      return false;
+   }
+   // One more byte than the file holds, so that reaching the end
+   // takes no second pass unless the file has grown.
+   text.resize (size_t (status.st_size) + 1);
+   size_t length = 0;
+   for (;;) {
+      if (length == text.size()) text.resize (length * 2);
+      ssize_t bytes = read (fd, &text[length], text.size() - length);
+      if (bytes == 0) break;
+      if (bytes < 0) {
+         if (errno == EINTR) continue;
+         int error = errno;
+         close (fd);
+         errno = error;
+         return false;
+      }
+      length += bytes;
+   }
+   close (fd);
+   text.resize (length);
+   return true;
+}
+
+//
+// import_files -
+//    Reads some of the files in one host directory into dir.  Each
+//    file is linked in as it is made, under dir's own lock, and the
+//    total of all of them is added to dir and up to the top of the
+//    import at once.
+//
+
+static void import_files (import_job* job, inode_ptr dir,
+                          const string& path,
+                          const vector<string>& names) {
+   static thread_local string text;
+   static thread_local viewvec words;
+   long total = 0;
+   for (const string& name: names) {
+      string file_path = path + "/" + name;
+      if (not read_host_file (file_path, text)) {
+         job->skip (file_path, strerror (errno));
+         continue;
+      }
+      split (text, WHITESPACE, words);
+      inode_ptr file = job->state.make_inode (PLAIN_INODE);
+      file->set_name (name);
+      file->get_plain_contents()->set_data (words);
+      dir->add_dirent (name, file);
+      total += file->get_total_size();
+   }
+   dir->adjust_total (total);
+}
+
+//
+// import_directory -
+//    The task for one host directory.  Each subdirectory is made
+//    and linked into dir here, and gets a task of its own.  Files
+//    are handed out FILES_PER_TASK at a time, and whatever is left
+//    at the end is read by this task.
+//
+
+static void import_directory (import_job* job, inode_ptr dir,
+                              const string& path) {
+   DIR* host_dir = opendir (path.c_str());
+   if (host_dir == nullptr) {
+      job->skip (path, strerror (errno));
+      return;
+   }
+   vector<string> files;
+   while (struct dirent* entry = readdir (host_dir)) {
+      if (is_dot (entry->d_name)) continue;
+      string name = entry->d_name;
+      string entry_path = path + "/" + name;
+      const char* why;
+      unsigned char type = kept_type (entry, entry_path, why);
+      if (type == DT_UNKNOWN) {
+         if (why != nullptr) job->skip (entry_path, why);
+         continue;
+      }
+      if (type == DT_DIR) {
+         inode_ptr child = job->state.make_inode (DIR_INODE);
+         child->set_name (name);
+         child->set_self (child);
+         child->set_parent (dir);
+         dir->add_dirent (name, child);
+         work_pool::spawn ([job, child, entry_path]() {
+            import_directory (job, child, entry_path);
+         });
+         continue;
+      }
+      files.push_back (name);
+      if (files.size() == FILES_PER_TASK) {
+         work_pool::spawn ([job, dir, path, files]() {
+            import_files (job, dir, path, files);
+         });
+         files.clear();
+      }
+   }
+   closedir (host_dir);
+   import_files (job, dir, path, files);
+}
+
+inode_ptr import_tree (inode_state& state, const string& host_dir,
+                       string& skipped) {
+   DIR* probe = opendir (host_dir.c_str());
+   if (probe == nullptr) {
+      throw yshell_exn (host_dir + ": " + strerror (errno));
+   }
+   closedir (probe);
+   import_job job (state);
+   inode_ptr top = state.make_inode (DIR_INODE);
+   top->set_self (top);
+   // Until it is linked in, the top has no parent, which is where
+   // adjust_total stops.
+   import_job* shared = &job;
+   work_pool::run ([shared, top, host_dir]() {
+      import_directory (shared, top, host_dir);
+   });
+   skipped = job.skipped();
+   DEBUGF ('h', host_dir << ": " << top->get_total_size()
+          << " bytes");
+   return top;
+}
+
+//
+// host_map -
+//    A host file mapped for as long as the host_map is in scope.
+//    Throws a yshell_exn if the file can not be mapped.
+//
+
+class host_map {
+   private:
+      const char* base {nullptr};
+      size_t length {0};
+   public:
+      host_map (const string& path);
+      host_map (const host_map&) = delete;
+      host_map& operator= (const host_map&) = delete;
+      ~host_map();
+      strview text() const { return strview (base, length); }
+};
+
+host_map::host_map (const string& path) {
+   int fd = open (path.c_str(), O_RDONLY);
+   struct stat status;
+   if (fd < 0 or fstat (fd, &status) < 0) {
+      int error = errno;
+      if (fd >= 0) close (fd);
+      throw yshell_exn (path + ": " + strerror (error));
+   }
+   length = status.st_size;
+   // An empty file can not be mapped, and has nothing to map.
+   if (length > 0) {
+      void* mapped = mmap (nullptr, length, PROT_READ, MAP_PRIVATE,
+                           fd, 0);
+      if (mapped == MAP_FAILED) {
+         int error = errno;
+         close (fd);
+         throw yshell_exn (path + ": " + strerror (error));
+      }
+      base = static_cast<const char*> (mapped);
+      madvise (mapped, length, MADV_SEQUENTIAL);
+   }
+   close (fd);
+}
+
+host_map::~host_map() {
+   if (base != nullptr) munmap (const_cast<char*> (base), length);
+}
+
+//
+// host_source -
+//    A mounted host directory.  Each directory and file below it
+//    that has been listed has a record, which is its host path.
+//    Records are only added, as directories are filled in, so the
+//    source grows with what has been looked at.
+//
+
+class host_source: public content_source,
+                   public enable_shared_from_this<host_source> {
+   private:
+      inode_state* state;
+      mutable mutex lock;
+      vector<string> paths;
+      string path_of (size_t record) const;
+      size_t add_path (const string& path);
+   public:
+      host_source (inode_state* state, const string& top);
+      void fill (directory& dir, size_t record) override;
+      void fill (plain_file& file, size_t record) override;
+      bool print (ostream& out, size_t record) override;
+};
+
+host_source::host_source (inode_state* state, const string& top):
+   state (state), paths {top} {
+}
+
+string host_source::path_of (size_t record) const {
+   lock_guard<mutex> guard (lock);
+   return paths.at (record);
+}
+
+size_t host_source::add_path (const string& path) {
+   lock_guard<mutex> guard (lock);
+   paths.push_back (path);
+   return paths.size() - 1;
+}
+
+//
+// The entries of a host directory are listed when it is filled in,
+// and each file is sized by the host's st_size, without reading it.
+// What the files hold is added to the directory's total and its
+// ancestors', up to the first one a snapshot may share.  Files
+// listed in a directory that is itself shared are sized zero, as no
+// total counts them.  A host directory that can not be read is
+// filled in empty.
+//
+
+void host_source::fill (directory& dir, size_t record) {
+   string path = path_of (record);
+   DEBUGF ('h', "listing " << path);
+   // The children belong to the same snapshots as their directory.
+   inode_ptr self = dir.get_self();
+   bool counted = not state->is_frozen (self);
+   DIR* host_dir = opendir (path.c_str());
+   if (host_dir == nullptr) return;
+   vector<inode_ptr> made_children;
+   long total = 0;
+   while (struct dirent* entry = readdir (host_dir)) {
+      if (is_dot (entry->d_name)) continue;
+      string name = entry->d_name;
+      string entry_path = path + "/" + name;
+      const char* why;
+      unsigned char type = kept_type (entry, entry_path, why);
+      if (type == DT_UNKNOWN) continue;
+      size_t child = add_path (entry_path);
+      inode_ptr made = state->make_inode (
+                       type == DT_DIR ? DIR_INODE : PLAIN_INODE, 0,
+                       self->get_epoch());
+      made->set_name (name);
+      if (type == DT_DIR) {
+         made->set_self (made);
+         made->set_parent (self);
+         made->get_directory_contents()->set_source (
+               shared_from_this(), child, 0, 0);
+      }else {
+         struct stat status;
+         size_t bytes = 0;
+         if (counted and stat (entry_path.c_str(), &status) == 0) {
+            bytes = status.st_size;
+         }
+         made->get_plain_contents()->set_source (shared_from_this(),
+                                                 child, bytes);
+         total += bytes;
+      }
+      made_children.push_back (made);
+   }
+   closedir (host_dir);
+   for (const inode_ptr& made: made_children) {
+      dir.insert_loaded (made->get_name(), made);
+   }
+   for (inode_ptr above = self; total > 0;) {
+      directory_ptr contents = above->get_directory_contents();
+      contents->add_total (total);
+      inode_ptr parent = contents->get_parent();
+      if (parent == nullptr or parent == above
+          or state->is_frozen (parent)) break;
+      above = parent;
+   }
+}
+
+void host_source::fill (plain_file& file, size_t record) {
+   string path = path_of (record);
+   DEBUGF ('h', "reading " << path);
+   host_map mapped (path);
+   static thread_local viewvec words;
+   split (mapped.text(), WHITESPACE, words);
+   file.set_data (words);
+}
+
+bool host_source::print (ostream& out, size_t record) {
+   host_map mapped (path_of (record));
+   tokenizer words (mapped.text(), WHITESPACE);
+   strview word;
+   bool first = true;
+   while (words.next (word)) {
+      if (not first) out << ' ';
+      out.write (word.data(), word.size());
+      first = false;
+   }
+   return true;
+}
+
+inode_ptr mount_tree (inode_state& state, const string& host_dir) {
+   DIR* probe = opendir (host_dir.c_str());
+   if (probe == nullptr) {
+      throw yshell_exn (host_dir + ": " + strerror (errno));
+   }
+   closedir (probe);
+   shared_ptr<host_source> source = make_shared<host_source> (
+                                    &state, host_dir);
+   inode_ptr top = state.make_inode (DIR_INODE);
+   top->set_self (top);
+   top->get_directory_contents()->set_source (source, 0, 0, 0);
+   return top;
+}
+
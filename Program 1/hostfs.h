@@ -0,0 +1,48 @@
+// $Id: hostfs.h,v 1.1 2015-02-16 11:40:22-08 - - $
+
+#ifndef __HOSTFS_H__
+#define __HOSTFS_H__
+
+#include <string>
+using namespace std;
+
+#include "inode.h"
+
+//
+// Trees read in from the host's file system.
+//
+// import_tree -
+//    Reads a host directory and everything below it into a new
+//    directory that is not yet linked into the tree, and returns
+//    it for the caller to name and link in.  The work pool walks
+//    the host tree, one task per directory and one per run of its
+//    files, each of which reads its files whole and splits them
+//    into words.  Only plain files and directories are read:
+//    symbolic links and special files are passed over.  Entries
+//    that can not be read, and names with white space in them,
+//    which no command could name, are left out, and skipped is set
+//    to say what was left out, or left empty.  Throws a yshell_exn
+//    if host_dir is not a directory that can be read.
+// mount_tree -
+//    Makes a directory, not yet linked into the tree, that lists
+//    a host directory when it is first looked into.  Nothing below
+//    it is read until then, and each directory below it is the
+//    same, so mounting takes the same time however big the host
+//    tree is.  The files below it stay lazy until they are changed
+//    or indexed:  cat reads them through a mapping of the host
+//    file, and what they hold is not kept.  A file's size is its
+//    host file's size in bytes until it is changed, and a directory
+//    counts only . and .. until it is listed.  du only counts what
+//    has been listed so far, and not what was listed in a directory
+//    a snapshot shares.  The same entries are passed over as by
+//    import_tree, and the host files are taken not to change while
+//    they are mounted.  Throws a yshell_exn if host_dir is not a
+//    directory that can be read.
+//
+
+inode_ptr import_tree (inode_state& state, const string& host_dir,
+                       string& skipped);
+inode_ptr mount_tree (inode_state& state, const string& host_dir);
+
+#endif
+
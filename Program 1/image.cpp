@@ -0,0 +1,281 @@
+// $Id: image.cpp,v 1.1 2015-01-24 15:20:37-08 - - $
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "image.h"
+
+static const char IMAGE_MAGIC[8] {'y','s','h','i','m','g','0','1'};
+
+struct image_header {
+   char magic[8];
+   uint32_t node_count;
+   uint32_t next_inode_nr;
+   uint64_t nodes_offset;
+   uint64_t names_offset;
+   uint64_t words_offset;
+   uint64_t file_size;
+};
+
+//
+// image_node -
+//    For a directory, first is the index of its first child, count
+//    is the number of children and size is its total.  For a file,
+//    first is the offset of its words, count is unused and size is
+//    the number of bytes of words.
+//
+
+struct image_node {
+   uint32_t inode_nr;
+   uint32_t type;
+   uint32_t name_offset;
+   uint32_t name_length;
+   uint64_t first;
+   uint64_t count;
+   uint64_t size;
+};
+
+static_assert (sizeof (image_header) == 48, "image_header layout");
+static_assert (sizeof (image_node) == 40, "image_node layout");
+
+//
+// image_source -
+//    A mapped image.  Every lazy directory and file made from it
+//    holds a pointer to it, and it is unmapped when the last of them
+//    has been filled in or freed.
+//
+
+class image_source: public content_source,
+                    public enable_shared_from_this<image_source> {
+   private:
+      inode_state* state;
+      const char* base;
+      size_t length;
+      const image_header* header;
+      const image_node* nodes;
+      const char* names;
+      const char* words;
+      size_t names_length;
+      size_t words_length;
+      const image_node& node_at (size_t record) const;
+   public:
+      image_source (inode_state* state, const char* base,
+                    size_t length);
+      ~image_source();
+      inode_ptr make_root();
+      void fill (directory& dir, size_t record) override;
+      void fill (plain_file& file, size_t record) override;
+};
+
+image_source::image_source (inode_state* state, const char* base,
+                            size_t length):
+   state (state), base (base), length (length),
+   header (reinterpret_cast<const image_header*> (base)) {
+   if (length < sizeof *header
+       or memcmp (header->magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC) != 0
+       or header->file_size != length
+       or header->node_count == 0
+       or header->nodes_offset % alignof (image_node) != 0
+       or header->nodes_offset > header->names_offset
+       or header->names_offset > header->words_offset
+       or header->words_offset > length
+       or (header->names_offset - header->nodes_offset)
+          / sizeof (image_node) < header->node_count) {
+      munmap (const_cast<char*> (base), length);
+      throw yshell_exn ("not a yshell image");
+   }
+   nodes = reinterpret_cast<const image_node*> (
+           base + header->nodes_offset);
+   names = base + header->names_offset;
+   names_length = header->words_offset - header->names_offset;
+   words = base + header->words_offset;
+   words_length = length - header->words_offset;
+   DEBUGF ('m', header->node_count << " nodes in " << length
+          << " bytes");
+}
+
+image_source::~image_source() {
+   DEBUGF ('m', "unmapping " << static_cast<const void*> (base));
+   munmap (const_cast<char*> (base), length);
+}
+
+const image_node& image_source::node_at (size_t record) const {
+   if (record >= header->node_count) {
+      throw yshell_exn ("image: bad node " + to_string (record));
+   }
+   const image_node& node = nodes[record];
+   bool bad_name = size_t (node.name_offset) + node.name_length
+                 > names_length;
+   bool bad_range = node.type == DIR_INODE
+                  ? node.first + node.count > header->node_count
+                  : node.first + node.size > words_length;
+   if (bad_name or bad_range
+       or (node.type != DIR_INODE and node.type != PLAIN_INODE)) {
+      throw yshell_exn ("image: bad node " + to_string (record));
+   }
+   return node;
+}
+
+inode_ptr image_source::make_root() {
+   const image_node& node = node_at (0);
+   if (node.type != DIR_INODE) throw yshell_exn ("image: bad root");
+   inode_ptr root = state->make_inode (DIR_INODE, node.inode_nr,
+                                       state->get_epoch());
+   root->set_name ("/");
+   root->set_parent (root);
+   root->set_self (root);
+   root->get_directory_contents()->set_source (
+         shared_from_this(), 0, node.count, node.size);
+   return root;
+}
+
+void image_source::fill (directory& dir, size_t record) {
+   const image_node& node = node_at (record);
+   DEBUGF ('m', "directory " << record << ", " << node.count
+          << " children");
+   // The children belong to the same snapshots as their directory.
+   // They are all made before any is added, so that a bad node
+   // leaves the directory as it was.
+   inode_ptr self = dir.get_self();
+   vector<inode_ptr> made_children;
+   made_children.reserve (node.count);
+   for (size_t child = node.first; child < node.first + node.count;
+        ++child) {
+      const image_node& entry = node_at (child);
+      inode_ptr made = state->make_inode (inode_t (entry.type),
+                                          entry.inode_nr,
+                                          self->get_epoch());
+      string name (names + entry.name_offset, entry.name_length);
+      made->set_name (name);
+      if (entry.type == DIR_INODE) {
+         made->set_self (made);
+         made->set_parent (self);
+         made->get_directory_contents()->set_source (
+               shared_from_this(), child, entry.count, entry.size);
+      }else {
+         made->get_plain_contents()->set_source (
+               shared_from_this(), child, entry.size);
+      }
+      made_children.push_back (made);
+   }
+   for (const inode_ptr& made: made_children) {
+      dir.insert_loaded (made->get_name(), made);
+   }
+}
+
+void image_source::fill (plain_file& file, size_t record) {
+   const image_node& node = node_at (record);
+   DEBUGF ('m', "file " << record << ", " << node.size << " bytes");
+   viewvec data;
+   split (strview (words + node.first, node.size), " ", data);
+   file.set_data (data);
+}
+
+void save_image (inode_state& state, const string& filename) {
+   // Number the inodes breadth first, so that the children of each
+   // directory are numbered in one run starting at first.
+   vector<inode_ptr> order {state.getroot()};
+   vector<image_node> nodes;
+   string names;
+   string words;
+   for (size_t index = 0; index < order.size(); ++index) {
+      inode_ptr next = order[index];
+      image_node node {};
+      node.inode_nr = next->get_inode_nr();
+      node.type = next->get_type();
+      if (index > 0) {
+         string name = next->get_name();
+         node.name_offset = names.size();
+         node.name_length = name.size();
+         names += name;
+      }
+      if (next->is_dir()) {
+         directory_ptr dir = next->get_directory_contents();
+         node.first = order.size();
+         node.size = dir->get_total();
+         for (directory::const_iterator itor = dir->begin();
+              itor != dir->end(); ++itor) {
+            if (itor->first == "." or itor->first == "..") continue;
+            order.push_back (itor->second);
+         }
+         node.count = order.size() - node.first;
+      }else {
+         wordvec data = next->get_plain_contents()->readfile();
+         node.first = words.size();
+         for (size_t word = 0; word < data.size(); ++word) {
+            if (word > 0) words += ' ';
+            words += data[word];
+         }
+         node.size = words.size() - node.first;
+      }
+      if (names.size() > UINT32_MAX) {
+         throw yshell_exn (filename + ": too many names for an image");
+      }
+      nodes.push_back (node);
+      order[index] = nullptr;
+   }
+   image_header header {};
+   memcpy (header.magic, IMAGE_MAGIC, sizeof IMAGE_MAGIC);
+   header.node_count = nodes.size();
+   header.next_inode_nr = state.get_inodes().get_next_nr();
+   header.nodes_offset = sizeof header;
+   header.names_offset = header.nodes_offset
+                       + nodes.size() * sizeof (image_node);
+   header.words_offset = header.names_offset + names.size();
+   header.file_size = header.words_offset + words.size();
+   // Write the image beside the old one and rename it over, since
+   // a loaded image may still be mapped by lazy nodes.
+   string temp = filename + ".tmp";
+   ofstream out (temp, ios::binary | ios::trunc);
+   out.write (reinterpret_cast<const char*> (&header), sizeof header);
+   out.write (reinterpret_cast<const char*> (nodes.data()),
+              nodes.size() * sizeof (image_node));
+   out.write (names.data(), names.size());
+   out.write (words.data(), words.size());
+   out.close();
+   if (out.fail() or rename (temp.c_str(), filename.c_str()) < 0) {
+      int error = errno;
+      unlink (temp.c_str());
+      throw yshell_exn (filename + ": " + strerror (error));
+   }
+   DEBUGF ('m', nodes.size() << " nodes saved to " << filename);
+}
+
+void load_image (inode_state& state, const string& filename) {
+   int fd = open (filename.c_str(), O_RDONLY);
+   if (fd < 0) throw yshell_exn (filename + ": " + strerror (errno));
+   struct stat info;
+   if (fstat (fd, &info) < 0 or info.st_size == 0) {
+      close (fd);
+      throw yshell_exn (filename + ": not a yshell image");
+   }
+   void* base = mmap (nullptr, info.st_size, PROT_READ, MAP_PRIVATE,
+                      fd, 0);
+   close (fd);
+   if (base == MAP_FAILED) {
+      throw yshell_exn (filename + ": " + strerror (errno));
+   }
+   shared_ptr<image_source> source;
+   inode_ptr root;
+   try {
+      source = make_shared<image_source> (
+               &state, static_cast<const char*> (base), info.st_size);
+      root = source->make_root();
+   }catch (yshell_exn&) {
+      throw yshell_exn (filename + ": not a yshell image");
+   }
+   state.replace_root (root, reinterpret_cast<const image_header*>
+                             (base)->next_inode_nr);
+}
+
@@ -0,0 +1,38 @@
+// $Id: image.h,v 1.1 2015-01-24 15:20:37-08 - - $
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <string>
+using namespace std;
+
+#include "inode.h"
+
+//
+// Saved images of the tree.
+//
+// An image is one file in three parts, after a fixed header:  an
+// array of fixed size node records, a pool of names, and the words
+// of every text file, each file's words joined by single spaces.
+// Records refer to names and words by offset within their own part,
+// and to other records by index, so the image holds no pointers and
+// can be mapped anywhere.  Records are laid out breadth first, which
+// puts the children of each directory in one contiguous run.  Fields
+// are in host byte order.
+//
+// save_image -
+//    Writes the whole tree to a file, throwing a yshell_exn if the
+//    file can not be written.
+// load_image -
+//    Maps an image and makes its top directory the new root.  Only
+//    the root is made here:  every other directory and file becomes
+//    an inode when its parent is first looked into, and a file's
+//    words are copied out of the image when it is first read.
+//    Throws a yshell_exn if the file is not an image.
+//
+
+void save_image (inode_state& state, const string& filename);
+void load_image (inode_state& state, const string& filename);
+
+#endif
+
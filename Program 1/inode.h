@@ -3,14 +3,25 @@
 #ifndef __INODE_H__
 #define __INODE_H__
 
+#include <atomic>
 #include <exception>
 #include <iostream>
-#include <memory>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <vector>
 using namespace std;
 
+#include "arena.h"
+#include "contents.h"
+#include "dcache.h"
+#include "inodetable.h"
+#include "dirents.h"
+#include "nameindex.h"
+#include "rwlock.h"
 #include "util.h"
+#include "wordindex.h"
 
 //
 // inode_t -
@@ -22,42 +33,194 @@ class inode;
 class file_base;
 class plain_file;
 class directory;
+class content_source;
 using inode_ptr = shared_ptr<inode>;
 using file_base_ptr = shared_ptr<file_base>;
 using plain_file_ptr = shared_ptr<plain_file>;
 using directory_ptr = shared_ptr<directory>;
+using content_source_ptr = shared_ptr<content_source>;
+
+//
+// session -
+//    What each user of the shared tree has to themselves:  a current
+//    directory, a prompt, and where their output goes.
+//
+
+struct session {
+   inode_ptr cwd {nullptr};
+   string prompt {"% "};
+   ostream* out {&cout};
+};
+
+//
+// needs_exclusive -
+//    Thrown by inode_state::writable when a command holding the tree
+//    shared has to copy frozen directories.  Nothing has been changed
+//    yet, and the command is run again holding the tree exclusively.
+//
+
+class needs_exclusive: public exception {};
 
 //
 // inode_state -
 //    A small convenient class to maintain the state of the simulated
-//    process:  the root (/), the current directory (.), and the
-//    prompt.
+//    process:  the root (/), the sessions using the tree, the
+//    dentry cache, and the name and word indexes.  Every inode and
+//    payload is allocated from the state's arena by make_inode.
+//
+// Each session runs on its own thread, and the accessors below act
+// on the calling thread's session, or on the console's.  Commands
+// hold the tree shared or exclusively through a tree_guard.
+// attach -
+//    Makes a session the calling thread's, starting it at the root.
+// detach -
+//    Forgets a session.  Must be called before it goes away.
+// out -
+//    Where the calling thread's command output goes.
+// redirect -
+//    Sends the calling thread's output elsewhere, returning where it
+//    went before.
+// make_inode -
+//    Makes an inode with the next free inode number, or with the
+//    number and epoch given, as read back from an image.
+// get_path -
+//    The absolute path of a directory, kept once found.
+// in_tree -
+//    Whether a directory is still linked into the tree.
+// paths_changed -
+//    Forgets every path kept, as when a directory is removed.
+// find_inode -
+//    The inode with a number, or nullptr.
+// index_tree -
+//    Rebuilds the stale name and word indexes asked for.  Throws
+//    needs_exclusive unless the tree is held exclusively.
+// replace_root -
+//    Puts a new root in place of the whole tree, with inode numbers
+//    to carry on from next_nr.
+// compact -
+//    Copies the tree depth first into arena chunks of its own, so
+//    that each directory's entries lie together.  Throws a
+//    yshell_exn if there are snapshots.
+//
+// Snapshots and copies share the tree:  taking one freezes every
+// inode made so far, and a frozen directory is copied, with the
+// path above it, before it is changed.
+// is_frozen -
+//    Whether an inode may be part of some snapshot.
+// writable -
+//    The current tree's own copy of a directory, made if it is
+//    frozen.  Use only the returned directory to make changes.
+// take_snapshot -
+//    Records the tree and cwd under a name.
+// restore_snapshot -
+//    Makes a snapshot the current tree, moving every session to its
+//    root.  Returns false if there is no such snapshot.
+// drop_snapshot -
+//    Forgets a snapshot, returning false if there is none.
+// copy_subtree -
+//    A lazy copy of a file or directory with a new inode number, in
+//    O(1).  Needs the tree held exclusively.
+// renamable -
+//    The current tree's own copy of an inode about to be moved.
 //
-
 class inode_state {
    friend class inode;
+   friend class copy_source;
    friend ostream& operator<< (ostream& out, const inode_state&);
+   public:
+      struct snapshot {
+         inode_ptr root;
+         inode_ptr cwd;
+         int epoch;
+      };
+      class tree_guard;
    private:
       inode_state (const inode_state&) = delete; // delete copy ctor
       inode_state& operator= (const inode_state&) = delete; 
+      slab_arena arena;
+      content_store store {&arena};
+      inode_table inodes;
       inode_ptr root {nullptr};
-      inode_ptr cwd {nullptr};
-      string prompt {"% "};
+      session console;
+      set<session*> sessions {&console};
+      mutex session_lock;
+      static thread_local session* active;
+      static thread_local bool exclusive;
+      rw_lock tree_lock;
+      dentry_cache dcache;
+      word_index windex;
+      name_index nindex;
+      int epoch {1};
+      int frozen_epoch {0};
+      int copied_epoch {0};
+      int path_generation {0};
+      map<string,snapshot> snapshots;
+      void dismantle(inode_ptr& top);
+      void relink(inode_ptr top);
+      inode_ptr copy_directory(inode_ptr dir);
+      inode_ptr copy_inode(inode_ptr from, int inode_nr,
+                           int node_epoch);
+      session& current();
+      void move_sessions(inode_ptr from, inode_ptr to);
    public:
       //Constructors and Destructors//
       inode_state();
       ~inode_state();
 
       //Accessors//
-     string getprompt();
+     const string& getprompt();
      inode_ptr getcwd();
      inode_ptr getroot();
+     ostream& out();
+     dentry_cache& get_dcache();
+     word_index& get_index();
+     name_index& get_names();
+     const slab_arena& get_arena();
+     const content_store& get_store();
+     const inode_table& get_inodes();
+     inode_ptr find_inode(int inode_nr);
+     string get_path(inode_ptr dir);
+     bool in_tree(inode_ptr dir);
+     void paths_changed();
+     int get_epoch();
+     bool is_frozen(inode_ptr node);
+     const map<string,snapshot>& get_snapshots();
   
      //Mutators//
+     inode_ptr make_inode(inode_t type);
+     inode_ptr make_inode(inode_t type, int inode_nr, int epoch);
      void make_new_root();
+     void replace_root(inode_ptr newroot, int next_nr);
+     void index_tree(bool words, bool names);
+     void compact();
      void setprompt(const string &newprompt);
      void set_cwd_to_root();
      void set_cwd(inode_ptr node);
+     inode_ptr writable(inode_ptr dir);
+     inode_ptr copy_subtree(inode_ptr from);
+     inode_ptr renamable(inode_ptr node);
+     void take_snapshot(const string& name);
+     bool restore_snapshot(const string& name);
+     bool drop_snapshot(const string& name);
+     void attach(session& mine);
+     void detach(session& mine);
+     ostream* redirect(ostream* to);
+};
+
+//
+// class inode_state::tree_guard -
+//    Holds the tree shared or exclusively for one command.
+//
+
+class inode_state::tree_guard {
+   private:
+      inode_state& state;
+      bool was_exclusive;
+   public:
+      tree_guard (inode_state& state, bool exclusive);
+      tree_guard (const tree_guard&) = delete;
+      tree_guard& operator= (const tree_guard&) = delete;
+      ~tree_guard();
 };
 
 
@@ -65,15 +228,36 @@ class inode_state {
 // class inode -
 //
 // inode ctor -
-//    Create a new inode of the given type.
+//    Create a new inode of the given type, with its payload
+//    allocated from the given arena, and a file's words kept in
+//    the given store.
 // get_inode_nr -
 //    Retrieves the serial number of the inode.  Inode numbers are
-//    allocated in sequence by small integer.
+//    small integers, given out by the inode table, which gives the
+//    number of an inode that has gone away to the next one made.
+// get_live_count -
+//    The number of inodes currently in existence.
+// get_epoch -
+//    The snapshot epoch the inode was made in.  See inode_state.
+// footprint -
+//    Roughly how many bytes of the arena this inode and its payload
+//    take up, not counting anything below it, nor its name, which is
+//    in the symbol table.
+// get_name -
+//    The name is kept as a symbol, and its string is only looked up
+//    here.
 // size -
 //    Returns the size of an inode.  For a directory, this is the
 //    number of dirents.  For a text file, the number of characters
 //    when printed (the sum of the lengths of each word, plus the
 //    number of words.
+// get_total_size -
+//    For a text file, its size.  For a directory, the sum of the
+//    sizes of every text file below it, kept up to date as files
+//    are made and removed so that du never walks the tree.
+// adjust_total -
+//    Adds delta to the total of this directory and each of its
+//    ancestors up to the root.
 //    
 
 class inode {
@@ -81,25 +265,34 @@ class inode {
    //friend ostream &operator<< (ostream &out, inode_ptr inode);
    private:
       int inode_nr;
+      int epoch {0};
       inode_t type;
       file_base_ptr contents;
-      static int next_inode_nr;
-      string name;
+      inode_table* table {nullptr};
+      static atomic<size_t> live_count;
+      symbol name {symbols::NONE};
    public:
       //Constructor//
-      inode (inode_t init_type);
+      inode (inode_t init_type, slab_arena* arena,
+             content_store* store, int init_nr);
       inode (inode* const that); 
+      inode (const inode&) = delete;
       inode &operator= ( const inode &from); 
+      ~inode();
+      static size_t get_live_count();
   
        //Accessors//
        int get_inode_nr() const;
-       string get_name();
+       int get_epoch() const;
+       size_t footprint();
+       const string& get_name();
        inode_t get_type();
        inode_ptr get_parent();
-       inode_ptr get_child_dir(const string& childname);
+       inode_ptr get_child_dir(strview childname);
        plain_file_ptr get_plain_contents();
        directory_ptr get_directory_contents();
        file_base_ptr get_contents();
+       size_t get_total_size();
   
        //Setters//
        void set_name(const string &newname);
@@ -107,8 +300,9 @@ class inode {
        void set_parent_first(inode_ptr parent);
        void set_self(inode_ptr self);
        void set_self_first(inode_ptr self);
-       void add_dirent(const string &name, inode_ptr addition);
-       void add_file(string &name, inode_ptr newfile);
+       bool add_dirent(const string &name, inode_ptr addition);
+       bool add_file(string &name, inode_ptr newfile);
+       void adjust_total(long delta);
   
        //Booleans//
        bool is_dir();
@@ -140,56 +334,278 @@ class file_base {
 };
 
 
+//
+// class content_source -
+//    Somewhere the contents of a directory or file can be read from
+//    when they are first needed, such as a saved image.  A lazy
+//    payload holds on to its source and the number of its record
+//    there, and asks the source to fill it in on first use.
+// fill -
+//    Fills in a lazy directory or file.  If it throws, it leaves
+//    the payload as it was, still lazy, so it may be asked again.
+// print -
+//    Writes a lazy file's words as printfile would, straight from
+//    the source, and returns true, or returns false if the file has
+//    to be filled in to be printed, which is the default.
+//
+
+class content_source {
+   public:
+      virtual ~content_source() = default;
+      virtual void fill (directory& dir, size_t record) = 0;
+      virtual void fill (plain_file& file, size_t record) = 0;
+      virtual bool print (ostream& out, size_t record);
+};
+
 //
 // class plain_file -
 //
-// Used to hold data.
-// synthesized default ctor -
-//    Default vector<string> is a an empty vector.
+// Used to hold data.  The words are kept in chunks of up to about
+// CHUNK_BYTES of text, each a payload of the content store, which
+// may be shared with other files having the same words.  A payload
+// never changes, so changing a file points it at other chunks.
+// Words appended go into a tail the file has to itself, made on
+// the first append and made a chunk when it is full, so that a file
+// grown a few words at a time does not make a chunk, or copy its
+// words, per append.
+// ctor -
+//    Starts out empty, with the words to be kept in the store.
+// size -
+//    Kept up to date as the words change, so this does not look at
+//    them.
 // readfile -
 //    Returns a copy of the contents of the wordvec in the file.
 //    Throws an yshell_exn for a directory.
+// printfile -
+//    Writes the words to out, with a space between each, one chunk
+//    at a time, without copying them.  A lazy file is printed by its
+//    source if it can be, and left lazy.
 // writefile -
 //    Replaces the contents of a file with new contents.
 //    Throws an yshell_exn for a directory.
+// word_count -
+//    The number of words in the file.
+// append -
+//    Adds words to the end, in time proportional to their length.
+// overwrite -
+//    Replaces words starting at a word offset no greater than
+//    word_count, adding any that go past the end.  Only the chunks
+//    the new words fall in are made again.
+// set_source -
+//    Makes the file lazy:  its words are read from the source the
+//    first time they are asked for.  Its size is known up front.
+// copy_from -
+//    Gives a file the same words as another in place of its own,
+//    sharing its chunks, or the same source if the other has not
+//    been loaded yet.
+// view_words -
+//    Adds a view of each word to the end of views.  The views are
+//    good until the file is changed.
+// relocate -
+//    Points the file at copies of its chunks made in the arena now.
+//    See content_store::relocate.
+// footprint -
+//    Roughly how many bytes the words take up, with each chunk's
+//    split evenly between the files sharing it.
 //
 
 class plain_file: public file_base {
    private:
-      wordvec data;
+      static constexpr size_t CHUNK_BYTES = 65536;
+      content_store* store;
+      struct word_tail {
+         string text;
+         vector<uint32_t> starts;
+      };
+      vector<payload_ptr> chunks;
+      unique_ptr<word_tail> tail;
+      size_t bytes {0};
+      size_t words {0};
+      mutable content_source_ptr source;
+      mutable atomic<bool> lazy {false};
+      size_t record {0};
+      void load() const;
+      void clear();
+      void add_chunks(viewvec_itor begin, viewvec_itor end,
+                      vector<payload_ptr>& into);
+      void push_tail(strview word);
+      strview tail_word(size_t index) const;
+      void seal_tail();
+      void recount();
    public:
+      plain_file (content_store* store);
+      plain_file (const plain_file&) = delete;
+      plain_file& operator= (const plain_file&) = delete;
+      ~plain_file();
       size_t size() const override;
-      const wordvec& readfile() const;
-      void writefile (const wordvec& newdata);
-      void set_data(wordvec data2);
+      wordvec readfile() const;
+      void printfile(ostream& out) const;
+      void writefile (const viewvec& newdata);
+      void set_data(const viewvec& data2);
+      size_t word_count() const;
+      void append(viewvec_itor begin, viewvec_itor end);
+      void overwrite(size_t offset, viewvec_itor begin,
+                     viewvec_itor end);
+      void set_source(content_source_ptr from, size_t from_record,
+                      size_t from_bytes);
+      void copy_from(const plain_file& that);
+      void view_words(viewvec& views) const;
+      void relocate();
+      size_t footprint() const;
 };
 
 //
 // class directory -
 //
-// Used to map filenames onto inode pointers.
+// Used to map filenames onto inode pointers.  Each directory locks
+// itself around lookups and changes.  Callers iterating over the
+// dirents hold a read_guard.
 // default ctor -
-//    Creates a new map with keys "." and "..".
+//    Creates a new map with keys "." and "..".  Those two are not
+//    owning:  the directory only keeps weak pointers to itself and
+//    its parent, so that unlinking a subtree frees it.
 // remove -
 //    Purposely left blank due to errors. See implementation.
 // mkdir -
 //    Purposely left blank due to errors. See implementation.
 // mkfile -
 //    Purposely left blank due to errors. See implementation.
+// lookup -
+//    Returns the inode bound to a name, or nullptr.
+// set_dirents -
+//    Adds a dirent, returning false if the name was already there.
+// erase -
+//    Removes a dirent, returning false if there was none.
+// erase_children -
+//    Removes every dirent other than "." and "..".
+// get_total, add_total -
+//    The sum of the sizes of all text files below this directory.
+//    See inode::get_total_size.
+// begin, end -
+//    Iterate over the dirents in name order.  Each dirent has a
+//    first (the name) and a second (the inode).
+// set_source -
+//    Makes the directory lazy:  its dirents are read from the source
+//    the first time they are needed.  Until then its size and total
+//    come from the counts given here, so ls and du of its parent do
+//    not touch it.
+// is_loaded -
+//    False while the directory is still waiting on its source.
+// insert_loaded -
+//    Adds a dirent for a content_source filling the directory in,
+//    which already holds the lock.
+// reserve -
+//    Makes room for count dirents, counting "." and "..", before a
+//    directory is filled in.
+// replace -
+//    Binds an existing name to another inode, returning false if
+//    there is no such name.
+// copy_from -
+//    Fills an empty directory with the same dirents and total as
+//    another, sharing the inodes, or with the same source if the
+//    other has not been loaded yet.
+// get_path, set_path -
+//    The directory's absolute path as last found, if it was found in
+//    the given generation of the tree's paths.  See
+//    inode_state::get_path.
+// footprint -
+//    Roughly how many bytes of the arena the dirents take up.
+//
 
 class directory: public file_base {
    private:
-      map<string,inode_ptr> dirents;
+      dirent_table dirents;
+      weak_ptr<inode> self;
+      weak_ptr<inode> parent;
+      atomic<size_t> total {0};
+      atomic<size_t> entries {0};
+      mutable rw_lock lock;
+      mutable content_source_ptr source;
+      mutable atomic<bool> lazy {false};
+      size_t record {0};
+      size_t pending {0};
+      struct known_path {
+         int generation;
+         string path;
+      };
+      shared_ptr<const known_path> path;
+      inode_ptr resolve (strview name, inode_ptr node) const;
+      void load() const;
    public:
+      class const_iterator;
+      class read_guard;
+      directory (slab_arena* arena);
       size_t size() const override;
       void remove (const string& filename);
       inode& mkdir (const string& dirname);
       inode& mkfile (const string& filename);
-      void set_dirents(const string& name, inode_ptr node);
+      bool set_dirents(const string& name, inode_ptr node);
+      void insert_loaded(const string& name, inode_ptr node);
+      void reserve(size_t count);
+      void set_self (inode_ptr node);
+      void set_parent (inode_ptr node);
+      inode_ptr get_self();
       inode_ptr get_parent();
-      map<string, inode_ptr>* get_dirents();
-      void print_contents();
-  
+      inode_ptr lookup (strview name) const;
+      bool erase (const string& name);
+      void erase_children();
+      size_t get_total() const;
+      void add_total(long delta);
+      const_iterator begin() const;
+      const_iterator end() const;
+      void set_source(content_source_ptr from, size_t from_record,
+                      size_t count, size_t from_total);
+      bool is_loaded() const;
+      bool replace(const string& name, inode_ptr node);
+      void copy_from(const directory& that);
+      bool get_path(int generation, string& found) const;
+      void set_path(int generation, const string& newpath);
+      size_t footprint() const;
+};
+
+class directory::read_guard {
+   private:
+      const directory& dir;
+   public:
+      explicit read_guard (const directory& that): dir (that) {
+         dir.load();
+         dir.lock.lock_shared();
+      }
+      read_guard (const read_guard&) = delete;
+      read_guard& operator= (const read_guard&) = delete;
+      ~read_guard() { dir.lock.unlock_shared(); }
+};
+
+class directory::const_iterator {
+   friend class directory;
+   public:
+      struct dirent {
+         const string& first;
+         inode_ptr second;
+      };
+   private:
+      struct arrow {
+         dirent entry;
+         const dirent* operator->() const { return &entry; }
+      };
+      const directory* dir;
+      dirent_table::const_iterator where;
+      const_iterator (const directory* dir,
+                      dirent_table::const_iterator where):
+                      dir (dir), where (where) {}
+   public:
+      dirent operator*() const {
+         const string& name = symbols::name (where->first);
+         return {name, dir->resolve (name, where->second)};
+      }
+      arrow operator->() const { return {**this}; }
+      const_iterator& operator++() { ++where; return *this; }
+      bool operator== (const const_iterator& that) const {
+         return where == that.where;
+      }
+      bool operator!= (const const_iterator& that) const {
+         return where != that.where;
+      }
 };
 
 #endif
@@ -0,0 +1,136 @@
+// $Id: inodetable.cpp,v 1.1 2015-02-09 10:12:47-08 - - $
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+#include "debug.h"
+#include "inode.h"
+#include "inodetable.h"
+
+inode_table::slot& inode_table::slot_of (int inode_nr) {
+   if (size_t (inode_nr) >= slots.size()) slots.resize (inode_nr + 1);
+   return slots[inode_nr];
+}
+
+void inode_table::trim() {
+   // Number 0 is never given out, and numbers below the floor may
+   // still be in a lazily loaded image.
+   while (slots.size() > size_t (floor) and slots.back().holders == 0) {
+      slots.pop_back();
+   }
+   if (slots.capacity() > 64 and slots.size() < slots.capacity() / 4) {
+      slots.shrink_to_fit();
+   }
+   // Numbers trimmed off are left in the free list, and skipped
+   // when they come off it, unless there are too many of them.
+   if (free_numbers.size() > slots.size()) {
+      int end = slots.size();
+      auto trimmed = [end] (int nr) { return nr >= end; };
+      free_numbers.erase (remove_if (free_numbers.begin(),
+                                     free_numbers.end(), trimmed),
+                          free_numbers.end());
+   }
+   if (free_numbers.capacity() > 64
+       and free_numbers.size() < free_numbers.capacity() / 4) {
+      free_numbers.shrink_to_fit();
+   }
+}
+
+int inode_table::claim() {
+   lock_guard<mutex> guard (lock);
+   while (not free_numbers.empty()) {
+      int nr = free_numbers.back();
+      free_numbers.pop_back();
+      if (size_t (nr) >= slots.size()) continue;
+      slot& free = slots[nr];
+      if (free.holders > 0 or free.pinned) continue;
+      free.holders = 1;
+      DEBUGF ('t', "reusing " << nr);
+      return nr;
+   }
+   int nr = slots.size();
+   slots.emplace_back();
+   slots.back().holders = 1;
+   return nr;
+}
+
+void inode_table::claim (int inode_nr) {
+   lock_guard<mutex> guard (lock);
+   ++slot_of (inode_nr).holders;
+}
+
+void inode_table::link (const inode_ptr& node) {
+   lock_guard<mutex> guard (lock);
+   slot_of (node->get_inode_nr()).node = node;
+}
+
+void inode_table::release (int inode_nr) {
+   lock_guard<mutex> guard (lock);
+   if (size_t (inode_nr) >= slots.size()) return;
+   slot& held = slots[inode_nr];
+   // Let go of the inode's memory if it was the one linked.
+   if (held.node.expired()) held.node.reset();
+   if (--held.holders > 0) return;
+   if (held.pinned) {
+      held.pinned = false;
+      DEBUGF ('t', "retiring " << inode_nr);
+      return;
+   }
+   free_numbers.push_back (inode_nr);
+   DEBUGF ('t', "freed " << inode_nr);
+   trim();
+}
+
+inode_ptr inode_table::find (int inode_nr) const {
+   lock_guard<mutex> guard (lock);
+   if (inode_nr <= 0 or size_t (inode_nr) >= slots.size()) {
+      return nullptr;
+   }
+   return slots[inode_nr].node.lock();
+}
+
+void inode_table::restart (int next_nr, const inode_ptr& root) {
+   lock_guard<mutex> guard (lock);
+   floor = max (next_nr, 1);
+   slot_of (floor - 1);
+   free_numbers.clear();
+   size_t root_nr = root->get_inode_nr();
+   for (size_t nr = 1; nr < slots.size(); ++nr) {
+      if (nr < size_t (floor)) {
+         int held = slots[nr].holders - (nr == root_nr ? 1 : 0);
+         slots[nr].pinned = held > 0;
+      }else if (slots[nr].holders == 0) {
+         free_numbers.push_back (nr);
+      }
+   }
+   trim();
+   DEBUGF ('t', "restarted at " << floor);
+}
+
+int inode_table::get_next_nr() const {
+   lock_guard<mutex> guard (lock);
+   return slots.size();
+}
+
+size_t inode_table::slot_count() const {
+   lock_guard<mutex> guard (lock);
+   return slots.size();
+}
+
+size_t inode_table::free_count() const {
+   lock_guard<mutex> guard (lock);
+   size_t count = 0;
+   for (size_t nr = 1; nr < slots.size(); ++nr) {
+      if (slots[nr].holders == 0 and not slots[nr].pinned) ++count;
+   }
+   return count;
+}
+
+size_t inode_table::bytes() const {
+   lock_guard<mutex> guard (lock);
+   return slots.capacity() * sizeof (slot)
+        + free_numbers.capacity() * sizeof (int);
+}
+
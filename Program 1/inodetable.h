@@ -0,0 +1,81 @@
+// $Id: inodetable.h,v 1.1 2015-02-09 10:12:47-08 - - $
+
+#ifndef __INODETABLE_H__
+#define __INODETABLE_H__
+
+#include <memory>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+//
+// class inode_table -
+//    Every live inode by inode number, in a vector indexed by the
+//    number, and the numbers free to be given out again.  A number
+//    is freed when the last inode holding it goes away, and the
+//    most recently freed is given out first, so the numbers in use
+//    stay about as few as the inodes alive.  When the highest
+//    numbers are freed the vector is trimmed, so it takes room in
+//    proportion to them too.
+//
+//    The copies writable makes of a frozen directory keep its
+//    number, so a number may be held by more than one inode:  the
+//    table counts them, and finds the one made or relinked last,
+//    which is the current tree's.  Every call takes the table's own
+//    lock, since inodes are made and freed by commands holding the
+//    tree shared.
+// claim -
+//    With no number, claims the next free one for a new inode.
+//    With a number, as when an inode is read back from an image or
+//    copied, counts one more inode holding it.
+// link -
+//    Makes an inode the one found by its number.
+// release -
+//    Counts one less inode holding a number, freeing it if that was
+//    the last.  Called as an inode goes away.
+// find -
+//    The inode with a number, or nullptr if there is none alive.
+// restart -
+//    Carries on from next_nr, which is past every number in an
+//    image just loaded, whose root is given.  An image loads lazily,
+//    so numbers below next_nr may be used at any time:  the ones
+//    still held by the old tree's inodes are never given out
+//    again.
+// get_next_nr -
+//    A number past every number in use.
+// slot_count, free_count, bytes -
+//    The size of the table, how many of its numbers no inode holds,
+//    and roughly how many bytes it takes up.
+//
+
+class inode_table {
+   private:
+      struct slot {
+         weak_ptr<inode> node;
+         int holders {0};
+         bool pinned {false};
+      };
+      mutable mutex lock;
+      vector<slot> slots {1};
+      vector<int> free_numbers;
+      int floor {1};
+      slot& slot_of (int inode_nr);
+      void trim();
+   public:
+      int claim();
+      void claim (int inode_nr);
+      void link (const inode_ptr& node);
+      void release (int inode_nr);
+      inode_ptr find (int inode_nr) const;
+      void restart (int next_nr, const inode_ptr& root);
+      int get_next_nr() const;
+      size_t slot_count() const;
+      size_t free_count() const;
+      size_t bytes() const;
+};
+
+#endif
+
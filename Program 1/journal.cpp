@@ -0,0 +1,280 @@
+// $Id: journal.cpp,v 1.1 2015-01-26 11:04:52-08 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "image.h"
+#include "journal.h"
+
+static const string IMAGE_TAG {"# image "};
+
+journal::journal (const string& filename, long window_ms,
+                  size_t checkpoint_every):
+   filename (filename), window (window_ms),
+   checkpoint_every (checkpoint_every) {
+   fd = open (filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+   if (fd < 0) throw yshell_exn (filename + ": " + strerror (errno));
+   if (window.count() > 0) {
+      flusher = thread (&journal::flush_loop, this);
+   }
+}
+
+journal::~journal() {
+   {
+      lock_guard<mutex> guard (lock);
+      stopping = true;
+   }
+   wakeup.notify_all();
+   if (flusher.joinable()) flusher.join();
+   write_out();
+   close (fd);
+}
+
+string journal::image_of (size_t number) const {
+   return filename + "." + to_string (number);
+}
+
+void journal::write_fully (int to, const string& data) {
+   size_t done = 0;
+   while (done < data.size()) {
+      ssize_t count = write (to, data.data() + done,
+                             data.size() - done);
+      if (count < 0) {
+         if (errno == EINTR) continue;
+         complain() << filename << ": " << strerror (errno) << endl;
+         return;
+      }
+      done += count;
+   }
+}
+
+//
+// write_out -
+//    Takes the whole buffer and writes it with one fsync.  The io
+//    lock is taken first so batches reach the file in order.
+//
+
+void journal::write_out() {
+   lock_guard<mutex> io_guard (io_lock);
+   string batch;
+   {
+      lock_guard<mutex> guard (lock);
+      batch.swap (buffer);
+   }
+   if (batch.empty()) return;
+   write_fully (fd, batch);
+   if (fdatasync (fd) < 0) {
+      complain() << filename << ": " << strerror (errno) << endl;
+   }
+   DEBUGF ('j', batch.size() << " bytes synced");
+}
+
+void journal::flush_loop() {
+   unique_lock<mutex> guard (lock);
+   while (not stopping) {
+      if (buffer.empty()) {
+         wakeup.wait (guard);
+         continue;
+      }
+      clock::time_point due = oldest + window;
+      if (clock::now() < due) {
+         wakeup.wait_until (guard, due);
+         continue;
+      }
+      guard.unlock();
+      write_out();
+      guard.lock();
+   }
+}
+
+void journal::recover (inode_state& state, commands& cmdmap) {
+   // What the commands print was seen when they were first run.
+   ostream discard (nullptr);
+   ostream* before = state.redirect (&discard);
+   try {
+      replay (state, cmdmap);
+   }catch (...) {
+      state.redirect (before);
+      throw;
+   }
+   state.redirect (before);
+}
+
+void journal::replay (inode_state& state, commands& cmdmap) {
+   ifstream in (filename);
+   string line;
+   viewvec words;
+   size_t kept = 0;
+   size_t replayed = 0;
+   while (getline (in, line)) {
+      // A last line with no newline was torn by a crash.
+      if (in.eof()) break;
+      kept += line.size() + 1;
+      if (line.compare (0, IMAGE_TAG.size(), IMAGE_TAG) == 0) {
+         generation = stoul (line.substr (IMAGE_TAG.size()));
+         load_image (state, image_of (generation));
+         continue;
+      }
+      split (line, " \t", words);
+      if (words.size() == 0) continue;
+      bool output = words.size() >= 3 and words[0] == "#"
+                    and (words[1] == ">" or words[1] == ">>");
+      bool piped = words.size() >= 3 and words[0] == "#"
+                   and words[1] == "|";
+      if (words[0] == "#" and not output and not piped) continue;
+      try {
+         if (output) {
+            write_output (state, words[2], words[1] == ">>",
+                          words.begin() + 3, words.end());
+         }else if (piped) {
+            viewvec run (words.begin() + 2, words.end());
+            run_command (state, cmdmap.at (run[0]), run);
+         }else {
+            run_line (state, cmdmap, words);
+         }
+      }catch (yshell_exn&) {
+         // It failed the same way when it was first run.
+      }
+      ++replayed;
+   }
+   if (ftruncate (fd, kept) < 0) {
+      throw yshell_exn (filename + ": " + strerror (errno));
+   }
+   since_checkpoint = replayed;
+   DEBUGF ('j', "generation " << generation << ", " << replayed
+          << " commands replayed");
+}
+
+//
+// runs_any -
+//    Whether any command in a line is one of those given.
+//
+
+static bool runs_any (const viewvec& line,
+                      initializer_list<const char*> names) {
+   for (size_t index = 0; index < line.size(); ++index) {
+      if (index > 0 and line[index - 1] != "|") continue;
+      for (const char* name: names) {
+         if (line[index] == name) return true;
+      }
+   }
+   return false;
+}
+
+static bool is_redirected (const viewvec& line) {
+   size_t size = line.size();
+   return size >= 3 and (line[size - 2] == ">"
+                         or line[size - 2] == ">>");
+}
+
+static bool is_piped (const viewvec& line) {
+   for (strview word: line) {
+      if (word == "|" or word == ">" or word == ">>") return true;
+   }
+   return false;
+}
+
+static bool changes_tree (const viewvec& line) {
+   return runs_any (line, {"append", "cd", "cp", "make", "mkdir",
+                           "mount", "mv", "prompt", "rm", "rmr",
+                           "write"});
+}
+
+bool journal::is_logged (const viewvec& line) {
+   // Output redirected into a file changes the tree.
+   return is_redirected (line) or changes_tree (line);
+}
+
+bool journal::is_replaced (const viewvec& line) {
+   return runs_any (line, {"import", "load", "restore"});
+}
+
+void journal::add_line (viewvec_itor begin, viewvec_itor end) {
+   {
+      lock_guard<mutex> guard (lock);
+      if (buffer.empty()) {
+         oldest = clock::now();
+         wakeup.notify_one();
+      }
+      for (viewvec_itor word = begin; word != end; ++word) {
+         if (word != begin) buffer += ' ';
+         buffer.append (word->data(), word->size());
+      }
+      buffer += '\n';
+   }
+   if (window.count() == 0) write_out();
+}
+
+void journal::record (const viewvec& words) {
+   if (not is_piped (words)) add_line (words.begin(), words.end());
+}
+
+void journal::record_run (const viewvec& run) {
+   // Written as a comment, "# > file words..." or "# | command
+   // words...", which no line typed in is journaled as.  The words
+   // piped in may themselves be "|" or ">".
+   bool output = run[0] == ">" or run[0] == ">>";
+   if (not output and not changes_tree (run)) return;
+   viewvec line {"#"};
+   if (not output) line.push_back ("|");
+   line.insert (line.end(), run.begin(), run.end());
+   add_line (line.begin(), line.end());
+}
+
+void journal::finished (inode_state& state) {
+   ++since_checkpoint;
+   if (since_checkpoint >= checkpoint_every
+       and state.in_tree (state.getcwd())) checkpoint (state);
+}
+
+void journal::sync() {
+   write_out();
+}
+
+void journal::checkpoint (inode_state& state) {
+   sync();
+   if (not state.in_tree (state.getcwd())) state.set_cwd_to_root();
+   size_t next = generation + 1;
+   string image_name = image_of (next);
+   save_image (state, image_name);
+   int image_fd = open (image_name.c_str(), O_RDONLY);
+   if (image_fd < 0 or fsync (image_fd) < 0) {
+      if (image_fd >= 0) close (image_fd);
+      throw yshell_exn (image_name + ": " + strerror (errno));
+   }
+   close (image_fd);
+
+   // Write the new journal beside the old one and rename it over.
+   string start = IMAGE_TAG + to_string (next) + "\n"
+                + "cd " + path_of (state, state.getcwd()) + "\n";
+   if (state.getprompt() != "% ") {
+      start += "prompt " + state.getprompt() + "\n";
+   }
+   string temp = filename + ".tmp";
+   lock_guard<mutex> io_guard (io_lock);
+   int temp_fd = open (temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC
+                                     | O_APPEND, 0666);
+   if (temp_fd < 0) throw yshell_exn (temp + ": " + strerror (errno));
+   write_fully (temp_fd, start);
+   if (fsync (temp_fd) < 0 or rename (temp.c_str(),
+                                      filename.c_str()) < 0) {
+      close (temp_fd);
+      throw yshell_exn (filename + ": " + strerror (errno));
+   }
+   close (fd);
+   fd = temp_fd;
+   if (generation > 0) unlink (image_of (generation).c_str());
+   generation = next;
+   since_checkpoint = 0;
+   DEBUGF ('j', "checkpoint " << generation);
+}
+
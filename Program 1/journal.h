@@ -0,0 +1,115 @@
+// $Id: journal.h,v 1.1 2015-01-26 11:04:52-08 - - $
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+using namespace std;
+
+#include "commands.h"
+#include "inode.h"
+#include "util.h"
+
+//
+// class journal -
+//    An append-only log of the commands that change the tree, the
+//    cwd or the prompt, so that a session can be rebuilt after a
+//    crash.  Each command is recorded before it is run, one line per
+//    command.  Lines are gathered in a buffer and written with a
+//    single fsync once the oldest of them has waited for the window
+//    (group commit), so a crash loses at most one window of
+//    commands.  A window of zero syncs every command before it runs.
+//    Every so many commands the whole tree is saved as an image
+//    beside the journal (filename.N for the Nth checkpoint), and the
+//    journal is replaced by one that names that image and holds the
+//    cd and prompt needed to pick up from it.  The new journal is
+//    renamed into place only after the image is safely on disk, so
+//    a crash at any point leaves a journal and the image it names.
+// ctor -
+//    Opens or creates the journal.  Throws a yshell_exn on failure.
+// dtor -
+//    Syncs whatever is buffered.
+// recover -
+//    Loads the last checkpoint image, if any, and replays the
+//    journal on top of it, throwing away what the commands print.
+//    A torn last line is dropped.
+// is_logged -
+//    Whether a line is one that is journaled:  one that runs a
+//    command that changes the tree, or redirects its output into a
+//    file.  A load, restore or import is not:  the caller takes a
+//    checkpoint after it instead, so that replay never depends on
+//    an image, a snapshot or a host directory still being there.
+//    Snapshots themselves do not survive a restart.
+// record_run -
+//    Called through run_line's hook for a line with a pipe or a
+//    redirection.  Adds each command that changes the tree with the
+//    words piped into it, and the words a redirection is about to
+//    put into its file.  Replay runs that command on those words,
+//    or puts those words into the file, rather than running the
+//    commands before it again:  what they write may not be the same
+//    the second time, as inode numbers are given out again when a
+//    checkpoint is loaded, and mem counts bytes that are not saved.
+// is_replaced -
+//    Whether a line runs a load, restore or import.
+// record -
+//    Adds a command to the journal before it is run.  A line with a
+//    pipe or a redirection is left to record_run.
+// finished -
+//    Called after each journaled command has run, to checkpoint
+//    when it is time to.  An image only holds the tree, so while
+//    the cwd is a directory that has been removed the checkpoint is
+//    put off:  replaying from the last one removes it again.
+// sync -
+//    Writes out and fsyncs the buffered commands now.
+// checkpoint -
+//    Saves the tree and truncates the journal.  The cwd is picked
+//    up again with a cd, so a cwd that has been removed, which no
+//    path leads to, is first moved to the root, as replay finds it.
+//    That only happens after a load, restore or import, which can
+//    not put off their checkpoints.
+//
+
+class journal {
+   private:
+      using clock = chrono::steady_clock;
+      journal (const journal&) = delete;
+      journal& operator= (const journal&) = delete;
+      string filename;
+      size_t generation {0};
+      int fd {-1};
+      chrono::milliseconds window;
+      size_t checkpoint_every;
+      size_t since_checkpoint {0};
+      mutex io_lock;
+      mutex lock;
+      condition_variable wakeup;
+      thread flusher;
+      string buffer;
+      clock::time_point oldest;
+      bool stopping {false};
+      string image_of (size_t number) const;
+      void write_fully (int to, const string& data);
+      void write_out();
+      void replay (inode_state& state, commands& cmdmap);
+      void add_line (viewvec_itor begin, viewvec_itor end);
+      void flush_loop();
+   public:
+      journal (const string& filename, long window_ms,
+               size_t checkpoint_every);
+      ~journal();
+      void recover (inode_state& state, commands& cmdmap);
+      static bool is_logged (const viewvec& line);
+      static bool is_replaced (const viewvec& line);
+      void record (const viewvec& words);
+      void record_run (const viewvec& run);
+      void finished (inode_state& state);
+      void sync();
+      void checkpoint (inode_state& state);
+};
+
+#endif
+
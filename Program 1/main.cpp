@@ -11,22 +11,52 @@ using namespace std;
 #include "commands.h"
 #include "debug.h"
 #include "inode.h"
+#include "journal.h"
+#include "server.h"
 #include "util.h"
+#include "workpool.h"
 
 //
 // scan_options
-//    Options analysis:  The only option is -Dflags. 
+//    Options analysis:  -@flags sets debug flags, and -j threads
+//    sets the number of threads used to walk large trees.  -J file
+//    keeps a journal in file and recovers from it at startup, -W ms
+//    sets its group commit window, and -C count the number of
+//    commands between checkpoints.  -S socket serves sessions on a
+//    UNIX-domain socket instead of reading stdin.  It can not be
+//    used with a journal, since commands from several sessions at
+//    once could not be replayed in the same order.
 //
 
+string journal_name;
+string socket_name;
+long journal_window_ms {10};
+size_t checkpoint_every {100000};
+
 void scan_options (int argc, char** argv) {
    opterr = 0;
    for (;;) {
-      int option = getopt (argc, argv, "@:");
+      int option = getopt (argc, argv, "@:j:C:J:S:W:");
       if (option == EOF) break;
       switch (option) {
          case '@':
             debugflags::setflags (optarg);
             break;
+         case 'j':
+            work_pool::start (atoi (optarg));
+            break;
+         case 'C':
+            checkpoint_every = max (atol (optarg), 1L);
+            break;
+         case 'J':
+            journal_name = optarg;
+            break;
+         case 'S':
+            socket_name = optarg;
+            break;
+         case 'W':
+            journal_window_ms = max (atol (optarg), 0L);
+            break;
          default:
             complain() << "-" << (char) option << ": invalid option"
                        << endl;
@@ -36,6 +66,10 @@ void scan_options (int argc, char** argv) {
    if (optind < argc) {
       complain() << "operands not permitted" << endl;
    }
+   if (socket_name.size() > 0 and journal_name.size() > 0) {
+      complain() << "-J can not be used with -S" << endl;
+      journal_name.clear();
+   }
 }
 
 
@@ -55,6 +89,30 @@ int main (int argc, char** argv) {
    string prompt = "%";
    inode_state state;
    state.make_new_root();
+   unique_ptr<journal> log;
+   if (journal_name.size() > 0) {
+      try {
+         log.reset (new journal (journal_name, journal_window_ms,
+                                 checkpoint_every));
+         log->recover (state, cmdmap);
+      }catch (yshell_exn& exn) {
+         complain() << exn.what() << endl;
+         return exit_status_message();
+      }
+   }
+   if (socket_name.size() > 0) {
+      try {
+         serve (state, cmdmap, socket_name);
+      }catch (yshell_exn& exn) {
+         complain() << exn.what() << endl;
+      }
+      return exit_status_message();
+   }
+   // The line read and the views of its words are reused from one
+   // command to the next, so that once they have grown, running a
+   // command like cd, ls or cat allocates nothing.
+   string line;
+   viewvec words;
    try {
       for (;;) {
          try {
@@ -62,7 +120,6 @@ int main (int argc, char** argv) {
             // Read a line, break at EOF, and echo print the prompt
             // if one is needed.
             cout << state.getprompt() << " ";
-            string line;
             getline (cin, line);
             if (cin.eof()) {
                if (need_echo) cout << "^D";
@@ -74,15 +131,31 @@ int main (int argc, char** argv) {
    
             // Split the line into words and lookup the appropriate
             // function.  Complain or call it.
-            wordvec words = split (line, " \t");
+            split (line, " \t", words);
             DEBUGF ('y', "words = " << words);
-            command_fn fn;
             if ( words.size() > 0 && words.at(0).compare("#") != 0 ){
-               fn = cmdmap.at(words.at(0));
-               if (fn == NULL) {
-                  throw yshell_exn (words.at(0) + ": no such function");
+               bool logged = log != nullptr
+                             and journal::is_logged (words);
+               // A load, restore or import is not replayed, its
+               // result is checkpointed.  An import that left some
+               // host files out has still linked in the rest.
+               bool replaced = log != nullptr
+                               and journal::is_replaced (words);
+               if (logged) log->record (words);
+               run_hook hook = nullptr;
+               if (logged) {
+                  hook = [&log] (const viewvec& run) {
+                     log->record_run (run);
+                  };
+               }
+               try {
+                  run_line (state, cmdmap, words, hook);
+               }catch (yshell_exn&) {
+                  if (replaced) log->checkpoint (state);
+                  throw;
                }
-               fn (state, words);
+               if (logged) log->finished (state);
+               if (replaced) log->checkpoint (state);
             }
          }catch (yshell_exn& exn) {
             // If there is a problem discovered in any function, an
@@ -0,0 +1,103 @@
+// $Id: nameindex.cpp,v 1.1 2015-02-02 09:41:26-08 - - $
+
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+
+#include <fnmatch.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "inode.h"
+#include "nameindex.h"
+
+name_index::entry_list::iterator name_index::find_nr (
+                                 entry_list& list, int nr) {
+   return lower_bound (list.begin(), list.end(), nr,
+                       [] (const entry& one, int two) {
+                          return one.inode_nr < two;
+                       });
+}
+
+void name_index::add (const string& name, inode_ptr node,
+                      inode_ptr parent) {
+   int nr = node->get_inode_nr();
+   lock_guard<rw_lock> guard (lock);
+   entry_list& list = names[name];
+   auto where = find_nr (list, nr);
+   if (where != list.end() and where->inode_nr == nr) {
+      where->node = node;
+      where->parent = parent;
+   }else {
+      list.insert (where, {nr, node, parent});
+   }
+   DEBUGF ('x', "name " << name << " " << nr);
+}
+
+void name_index::remove (const string& name, int inode_nr) {
+   lock_guard<rw_lock> guard (lock);
+   auto list = names.find (name);
+   if (list == names.end()) return;
+   auto where = find_nr (list->second, inode_nr);
+   if (where == list->second.end() or where->inode_nr != inode_nr) {
+      return;
+   }
+   list->second.erase (where);
+   if (list->second.empty()) names.erase (list);
+}
+
+void name_index::move (const string& name, inode_ptr node,
+                       inode_ptr parent) {
+   int nr = node->get_inode_nr();
+   lock_guard<rw_lock> guard (lock);
+   auto list = names.find (name);
+   if (list == names.end()) return;
+   auto where = find_nr (list->second, nr);
+   if (where == list->second.end() or where->inode_nr != nr) return;
+   where->node = node;
+   where->parent = parent;
+}
+
+vector<name_index::found> name_index::match (const string& pattern)
+                                                               const {
+   size_t wild = pattern.find_first_of ("*?[\\");
+   string prefix = pattern.substr (0, wild);
+   shared_guard guard (lock);
+   vector<found> result;
+   auto itor = wild == string::npos ? names.find (prefix)
+                                    : names.lower_bound (prefix);
+   for (; itor != names.end(); ++itor) {
+      if (itor->first.compare (0, prefix.size(), prefix) != 0) break;
+      if (wild != string::npos
+          and fnmatch (pattern.c_str(), itor->first.c_str(), 0) != 0) {
+         continue;
+      }
+      for (const entry& each: itor->second) {
+         found one {each.node.lock(), each.parent.lock()};
+         if (one.node != nullptr and one.parent != nullptr) {
+            result.push_back (one);
+         }
+      }
+      if (wild == string::npos) break;
+   }
+   DEBUGF ('x', pattern << ": " << result.size() << " names");
+   return result;
+}
+
+void name_index::invalidate() {
+   lock_guard<rw_lock> guard (lock);
+   names.clear();
+   stale = true;
+}
+
+bool name_index::is_stale() const {
+   shared_guard guard (lock);
+   return stale;
+}
+
+void name_index::mark_current() {
+   lock_guard<rw_lock> guard (lock);
+   stale = false;
+}
+
@@ -0,0 +1,71 @@
+// $Id: nameindex.h,v 1.1 2015-02-02 09:41:26-08 - - $
+
+#ifndef __NAMEINDEX_H__
+#define __NAMEINDEX_H__
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+#include "rwlock.h"
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+//
+// class name_index -
+//    Every file and directory of the current tree, other than the
+//    root, by name, so that find need not walk the tree.  Names are
+//    kept in a sorted map, so all the names with a given prefix are
+//    one range of it.  Each name has a list of the inodes of that
+//    name, sorted by inode number, and each remembers the directory
+//    it is in, which gives its path.  Like the word index, it is
+//    marked stale by a load or a restore until it is rebuilt.
+//    Queries share the index, and changes take it exclusively.
+// add -
+//    Indexes an inode just linked into parent under name.
+// remove -
+//    Drops an inode, if it is indexed under name.
+// move -
+//    Records that an indexed inode has been replaced by a copy with
+//    the same number, or that it is now in another directory.
+// match -
+//    Returns every indexed inode, and its directory, whose name
+//    matches a shell glob pattern (*, ? and [...]).  A pattern with
+//    no wildcards is looked up directly, and otherwise only the
+//    names starting with its literal prefix are tried.
+// invalidate, is_stale, mark_current -
+//    As for the word index.
+//
+
+class name_index {
+   public:
+      struct found {
+         inode_ptr node;
+         inode_ptr parent;
+      };
+   private:
+      struct entry {
+         int inode_nr;
+         weak_ptr<inode> node;
+         weak_ptr<inode> parent;
+      };
+      using entry_list = vector<entry>;
+      mutable rw_lock lock;
+      map<string,entry_list> names;
+      bool stale {false};
+      static entry_list::iterator find_nr (entry_list& list, int nr);
+   public:
+      void add (const string& name, inode_ptr node, inode_ptr parent);
+      void remove (const string& name, int inode_nr);
+      void move (const string& name, inode_ptr node, inode_ptr parent);
+      vector<found> match (const string& pattern) const;
+      void invalidate();
+      bool is_stale() const;
+      void mark_current();
+};
+
+#endif
+
@@ -0,0 +1,44 @@
+// $Id: rwlock.h,v 1.1 2015-01-28 16:41:09-08 - - $
+
+#ifndef __RWLOCK_H__
+#define __RWLOCK_H__
+
+#include <pthread.h>
+
+//
+// class rw_lock -
+//    A reader/writer lock.  gnu++11 has no shared_mutex, so this
+//    wraps a pthread rwlock.  lock and unlock take it exclusively,
+//    so lock_guard works for writers.
+// class shared_guard -
+//    Holds an rw_lock shared for the life of the guard.
+//
+
+class rw_lock {
+   private:
+      pthread_rwlock_t handle;
+   public:
+      rw_lock() { pthread_rwlock_init (&handle, nullptr); }
+      rw_lock (const rw_lock&) = delete;
+      rw_lock& operator= (const rw_lock&) = delete;
+      ~rw_lock() { pthread_rwlock_destroy (&handle); }
+      void lock() { pthread_rwlock_wrlock (&handle); }
+      void unlock() { pthread_rwlock_unlock (&handle); }
+      void lock_shared() { pthread_rwlock_rdlock (&handle); }
+      void unlock_shared() { pthread_rwlock_unlock (&handle); }
+};
+
+class shared_guard {
+   private:
+      rw_lock& held;
+   public:
+      explicit shared_guard (rw_lock& lock): held (lock) {
+         held.lock_shared();
+      }
+      shared_guard (const shared_guard&) = delete;
+      shared_guard& operator= (const shared_guard&) = delete;
+      ~shared_guard() { held.unlock_shared(); }
+};
+
+#endif
+
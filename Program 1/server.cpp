@@ -0,0 +1,82 @@
+// $Id: server.cpp,v 1.1 2015-01-28 16:41:09-08 - - $
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <ext/stdio_filebuf.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#include "debug.h"
+#include "server.h"
+
+using socket_buf = __gnu_cxx::stdio_filebuf<char>;
+
+static void converse (inode_state& state, commands& cmdmap,
+                      int client) {
+   // Each direction gets its own descriptor, so that each buffer
+   // closes its own.
+   socket_buf inbuf (client, ios::in);
+   socket_buf outbuf (dup (client), ios::out);
+   istream in (&inbuf);
+   ostream out (&outbuf);
+   out << boolalpha;
+   session mine;
+   mine.out = &out;
+   state.attach (mine);
+   DEBUGF ('y', "session " << client << " attached");
+   // The line and its words are reused from one command to the next.
+   string line;
+   viewvec words;
+   for (;;) {
+      out << state.getprompt() << " " << flush;
+      if (not getline (in, line)) break;
+      split (line, " \t", words);
+      if (words.size() == 0 or words[0] == "#") continue;
+      try {
+         run_line (state, cmdmap, words);
+      }catch (yshell_exn& exn) {
+         out << execname() << ": " << exn.what() << endl;
+      }catch (ysh_exit_exn&) {
+         break;
+      }
+   }
+   out << flush;
+   state.detach (mine);
+   DEBUGF ('y', "session " << client << " detached");
+}
+
+void serve (inode_state& state, commands& cmdmap, const string& path) {
+   sockaddr_un address {};
+   address.sun_family = AF_UNIX;
+   if (path.size() >= sizeof address.sun_path) {
+      throw yshell_exn (path + ": socket name too long");
+   }
+   strcpy (address.sun_path, path.c_str());
+   int listener = socket (AF_UNIX, SOCK_STREAM, 0);
+   unlink (path.c_str());
+   if (listener < 0
+       or bind (listener, reinterpret_cast<sockaddr*> (&address),
+                sizeof address) < 0
+       or listen (listener, SOMAXCONN) < 0) {
+      string why = strerror (errno);
+      if (listener >= 0) close (listener);
+      throw yshell_exn (path + ": " + why);
+   }
+   DEBUGF ('y', "listening on " << path);
+   for (;;) {
+      int client = accept (listener, nullptr, nullptr);
+      if (client < 0) {
+         if (errno == EINTR) continue;
+         close (listener);
+         throw yshell_exn (path + ": " + strerror (errno));
+      }
+      thread (converse, ref (state), ref (cmdmap), client).detach();
+   }
+}
+
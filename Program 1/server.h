@@ -0,0 +1,25 @@
+// $Id: server.h,v 1.1 2015-01-28 16:41:09-08 - - $
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <string>
+using namespace std;
+
+#include "commands.h"
+#include "inode.h"
+
+//
+// serve -
+//    Listens on a UNIX-domain socket and gives each client that
+//    connects a session of its own, on a thread of its own, against
+//    the one shared tree.  A client sends commands one per line and
+//    gets back each command's output, any error, and the next
+//    prompt.  exit ends only that client's session.  Returns only
+//    if the socket can not be set up, by throwing a yshell_exn.
+//
+
+void serve (inode_state& state, commands& cmdmap, const string& path);
+
+#endif
+
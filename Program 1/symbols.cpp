@@ -0,0 +1,95 @@
+// $Id: symbols.cpp,v 1.1 2015-02-06 15:08:33-08 - - $
+
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+#include "debug.h"
+#include "symbols.h"
+
+constexpr symbol symbols::NONE;
+atomic<string*> symbols::blocks[BLOCKS];
+atomic<size_t> symbols::used {0};
+atomic<size_t> symbols::string_bytes {0};
+unordered_set<symbol,symbols::probe_hash,symbols::probe_equal>
+      symbols::table;
+rw_lock symbols::lock;
+thread_local strview symbols::probe;
+
+//
+// The table holds symbols, but hashes and compares them by their
+// strings.  A string being looked up is not a symbol yet, so it is
+// passed in through probe, and stands in for the symbol NONE.  It
+// is only viewed, so looking it up copies nothing.
+//
+
+size_t symbols::hash_of (strview text) {
+   // 64-bit FNV-1a.
+   uint64_t hash = 14695981039346656037ULL;
+   for (unsigned char letter: text) {
+      hash = (hash ^ letter) * 1099511628211ULL;
+   }
+   return hash;
+}
+
+size_t symbols::probe_hash::operator() (symbol key) const {
+   return hash_of (key == NONE ? probe : strview (name (key)));
+}
+
+bool symbols::probe_equal::operator() (symbol left,
+                                       symbol right) const {
+   strview one = left == NONE ? probe : strview (name (left));
+   strview two = right == NONE ? probe : strview (name (right));
+   return one == two;
+}
+
+symbol symbols::lookup (strview text) {
+   probe = text;
+   auto found = table.find (NONE);
+   return found == table.end() ? NONE : *found;
+}
+
+symbol symbols::find (strview text) {
+   shared_guard guard (lock);
+   return lookup (text);
+}
+
+symbol symbols::intern (strview text) {
+   {
+      shared_guard guard (lock);
+      symbol found = lookup (text);
+      if (found != NONE) return found;
+   }
+   lock_guard<rw_lock> guard (lock);
+   symbol found = lookup (text);
+   if (found != NONE) return found;
+   symbol made = used;
+   if (made == NONE) throw yshell_exn ("too many distinct strings");
+   size_t block = made >> BLOCK_BITS;
+   if (blocks[block] == nullptr) {
+      blocks[block].store (new string[BLOCK_SIZE],
+                           memory_order_release);
+   }
+   string& stored = blocks[block].load()[made & (BLOCK_SIZE - 1)];
+   stored.assign (text.data(), text.size());
+   table.insert (made);
+   ++used;
+   if (stored.capacity() > 15) string_bytes += stored.capacity() + 1;
+   DEBUGF ('s', made << " = " << text);
+   return made;
+}
+
+size_t symbols::count() {
+   return used;
+}
+
+size_t symbols::bytes() {
+   shared_guard guard (lock);
+   size_t block_count = (used + BLOCK_SIZE - 1) / BLOCK_SIZE;
+   return block_count * BLOCK_SIZE * sizeof (string) + string_bytes
+        + table.bucket_count() * sizeof (void*)
+        + table.size() * (sizeof (void*) + sizeof (symbol)
+                          + sizeof (size_t));
+}
+
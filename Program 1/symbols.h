@@ -0,0 +1,72 @@
+// $Id: symbols.h,v 1.1 2015-02-06 15:08:33-08 - - $
+
+#ifndef __SYMBOLS_H__
+#define __SYMBOLS_H__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+using namespace std;
+
+#include "rwlock.h"
+#include "util.h"
+
+//
+// symbols -
+//    A static class which interns strings:  each distinct string is
+//    given a 32-bit symbol the first time it is seen, and is stored
+//    once however many names and words use it.  Symbols are handed
+//    out in sequence and are never freed, so the table is meant for
+//    the limited vocabulary of names and words a tree reuses.  The
+//    string of a symbol never moves, so it may be held by reference
+//    for as long as the program runs, and looking it up takes no
+//    lock.
+// intern -
+//    Returns the symbol of a string, adding it if it is new.
+// find -
+//    Returns the symbol of a string, or NONE if it was never
+//    interned, which means no name or word is equal to it.
+// name -
+//    The string of a symbol.
+// count, bytes -
+//    How many strings are interned, and roughly how many bytes they
+//    and the table take up.
+//
+
+using symbol = uint32_t;
+
+class symbols {
+   public:
+      static constexpr symbol NONE = UINT32_MAX;
+   private:
+      static constexpr size_t BLOCK_BITS = 12;
+      static constexpr size_t BLOCK_SIZE = size_t (1) << BLOCK_BITS;
+      static constexpr size_t BLOCKS = size_t (1) << (32 - BLOCK_BITS);
+      struct probe_hash {
+         size_t operator() (symbol key) const;
+      };
+      struct probe_equal {
+         bool operator() (symbol left, symbol right) const;
+      };
+      static atomic<string*> blocks[BLOCKS];
+      static atomic<size_t> used;
+      static atomic<size_t> string_bytes;
+      static unordered_set<symbol,probe_hash,probe_equal> table;
+      static rw_lock lock;
+      static thread_local strview probe;
+      static size_t hash_of (strview text);
+      static symbol lookup (strview text);
+   public:
+      static symbol intern (strview text);
+      static symbol find (strview text);
+      static const string& name (symbol key) {
+         return blocks[key >> BLOCK_BITS].load (memory_order_acquire)
+                [key & (BLOCK_SIZE - 1)];
+      }
+      static size_t count();
+      static size_t bytes();
+};
+
+#endif
+
@@ -0,0 +1,63 @@
+#!/bin/sh
+# $Id: check.sh,v 1.1 2015-03-02 10:41:18-08 - - $
+#
+# Runs the tests in this directory against a yshell binary, by
+# default ../yshell.  Each NAME.ysh is fed to yshell and what it
+# prints, less the build line, is compared with NAME.out.  Each
+# NAME.jnl is fed to yshell keeping a journal that checkpoints every
+# few commands, and the tree and cwd it leaves are compared with
+# those recovered from the journal by a second run.  Inode numbers
+# are left out of the comparison, since a checkpoint image loaded
+# back gives out different ones.  Exits with the number of tests
+# that failed.
+#
+
+cd `dirname $0`
+YSHELL=${1:-../yshell}
+failed=0
+JOURNAL=/tmp/check.$$.jnl
+DUMP='echo ==dump==
+pwd
+lsr /
+du /'
+
+#
+# dump -
+#    Runs yshell with a journal and keeps what the dump commands
+#    print, without inode numbers.
+#
+dump () {
+   $YSHELL -J $JOURNAL -C 4 -W 1 2>&1 \
+   | sed -n '/^==dump==$/,$p' | grep -v '^yshell: exit' \
+   | sed 's/^[0-9][0-9]*  //'
+}
+
+for test in *.ysh
+do
+   name=`basename $test .ysh`
+   if $YSHELL <$test 2>&1 | tail -n +2 | cmp -s - $name.out
+   then
+      echo "$name: ok"
+   else
+      echo "$name: FAILED"
+      failed=`expr $failed + 1`
+   fi
+done
+
+for test in *.jnl
+do
+   name=`basename $test .jnl`
+   rm -f $JOURNAL $JOURNAL.*
+   live=`(cat $test; echo "$DUMP") | dump`
+   recovered=`echo "$DUMP" | dump`
+   rm -f $JOURNAL $JOURNAL.*
+   if [ "$live" = "$recovered" ]
+   then
+      echo "$name: ok"
+   else
+      echo "$name: FAILED"
+      failed=`expr $failed + 1`
+   fi
+done
+
+exit $failed
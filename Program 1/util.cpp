@@ -1,5 +1,6 @@
 // $Id: util.cpp,v 1.10 2014-06-11 13:34:25-07 - - $
 
+#include <algorithm>
 #include <cstdlib>
 #include <unistd.h>
 
@@ -11,6 +12,52 @@ using namespace std;
 yshell_exn::yshell_exn (const string& what): runtime_error (what) {
 }
 
+char strview::at (size_t pos) const {
+   if (pos >= length) throw out_of_range ("strview::at");
+   return chars[pos];
+}
+
+int strview::compare (strview that) const {
+   size_t common = min (length, that.length);
+   int result = common == 0 ? 0 : memcmp (chars, that.chars, common);
+   if (result != 0) return result;
+   return length < that.length ? -1 : length > that.length ? 1 : 0;
+}
+
+bool operator== (strview left, strview right) {
+   return left.size() == right.size() and (left.empty()
+       or memcmp (left.data(), right.data(), left.size()) == 0);
+}
+
+bool operator!= (strview left, strview right) {
+   return not (left == right);
+}
+
+bool operator< (strview left, strview right) {
+   return left.compare (right) < 0;
+}
+
+string operator+ (const string& left, strview right) {
+   string result (left);
+   return result.append (right.data(), right.size());
+}
+
+string operator+ (strview left, const string& right) {
+   return left.str() + right;
+}
+
+string operator+ (const char* left, strview right) {
+   return string (left) + right;
+}
+
+string operator+ (strview left, const char* right) {
+   return left.str() + right;
+}
+
+ostream& operator<< (ostream& out, strview view) {
+   return out.write (view.data(), view.size());
+}
+
 int exit_status::status = EXIT_SUCCESS;
 static string execname_string;
 
@@ -58,6 +105,30 @@ wordvec split (const string& line, const string& delimiters) {
    return words;
 }
 
+void split (strview line, const char* delimiters, viewvec& words) {
+   words.clear();
+   tokenizer words_of (line, delimiters);
+   strview word;
+   while (words_of.next (word)) words.push_back (word);
+   DEBUGF ('u', words);
+}
+
+bool tokenizer::is_delimiter (char letter) const {
+   return letter != '\0' and strchr (delimiters, letter) != nullptr;
+}
+
+bool tokenizer::next (strview& word) {
+   while (position < text.size() and is_delimiter (text[position])) {
+      ++position;
+   }
+   if (position == text.size()) return false;
+   size_t start = position;
+   while (position < text.size()
+          and not is_delimiter (text[position])) ++position;
+   word = strview (text.data() + start, position - start);
+   return true;
+}
+
 ostream& complain() {
    exit_status::set (EXIT_FAILURE);
    cerr << execname() << ": ";
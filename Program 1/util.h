@@ -9,18 +9,63 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 using namespace std;
 
+//
+// class strview -
+//    A view of a run of chars held by some other string, which must
+//    outlive the view and not change while it is in use.  Commands
+//    are picked apart into views over the line read, so that none
+//    of their words is copied unless it is kept.  A view converts
+//    to a string when one is needed.
+//
+
+class strview {
+   private:
+      const char* chars {nullptr};
+      size_t length {0};
+   public:
+      strview() = default;
+      strview (const char* chars, size_t length):
+               chars (chars), length (length) {}
+      strview (const char* text):
+               chars (text), length (strlen (text)) {}
+      strview (const string& text):
+               chars (text.data()), length (text.size()) {}
+      const char* data() const { return chars; }
+      size_t size() const { return length; }
+      bool empty() const { return length == 0; }
+      const char* begin() const { return chars; }
+      const char* end() const { return chars + length; }
+      char operator[] (size_t pos) const { return chars[pos]; }
+      char at (size_t pos) const;
+      int compare (strview that) const;
+      string str() const { return string (chars, length); }
+      operator string() const { return str(); }
+};
+
+bool operator== (strview left, strview right);
+bool operator!= (strview left, strview right);
+bool operator< (strview left, strview right);
+string operator+ (const string& left, strview right);
+string operator+ (strview left, const string& right);
+string operator+ (const char* left, strview right);
+string operator+ (strview left, const char* right);
+ostream& operator<< (ostream& out, strview view);
+
 //
 // Convenient type using to allow brevity of code elsewhere.
 //
 
 using wordvec = vector<string>;
 using wordvec_itor = wordvec::const_iterator;
+using viewvec = vector<strview>;
+using viewvec_itor = viewvec::const_iterator;
 
 //
 // yshell_exn -
@@ -79,6 +124,36 @@ class exit_status {
 
 wordvec split (const string& line, const string& delimiter);
 
+//
+// split (viewvec) -
+//    Splits in the same way, but into views over line, which must
+//    outlive them.  The words are cleared first, so a viewvec used
+//    for line after line stops allocating once it is big enough.
+//
+
+void split (strview line, const char* delimiters, viewvec& words);
+
+//
+// class tokenizer -
+//    Steps through the words of a string in place, as split finds
+//    them, without making a vector.  Used to walk pathnames.
+// next -
+//    Sets word to the next word and returns true, or returns false
+//    if there are no more.
+//
+
+class tokenizer {
+   private:
+      strview text;
+      const char* delimiters;
+      size_t position {0};
+      bool is_delimiter (char letter) const;
+   public:
+      tokenizer (strview text, const char* delimiters):
+                 text (text), delimiters (delimiters) {}
+      bool next (strview& word);
+};
+
 // complain -
 //    Used for starting error messages.  Sets the exit status to
 //    EXIT_FAILURE, writes the program name to cerr, and then
@@ -0,0 +1,215 @@
+// $Id: wordindex.cpp,v 1.1 2015-01-30 10:17:44-08 - - $
+
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+
+using namespace std;
+
+#include "debug.h"
+#include "inode.h"
+#include "wordindex.h"
+
+viewvec word_index::distinct_words (inode_ptr file) {
+   // Views of the file's own words, which it keeps while it is
+   // being indexed, rather than copies of them.
+   viewvec words;
+   file->get_plain_contents()->view_words (words);
+   sort (words.begin(), words.end());
+   words.erase (unique (words.begin(), words.end()), words.end());
+   return words;
+}
+
+void word_index::add (inode_ptr file, inode_ptr parent) {
+   viewvec words = distinct_words (file);
+   int file_nr = file->get_inode_nr();
+   lock_guard<rw_lock> guard (lock);
+   for (strview word: words) {
+      posting_list& list = postings[word.str()];
+      // New files have the highest numbers, so this is usually an
+      // append.
+      auto where = lower_bound (list.begin(), list.end(), file_nr);
+      if (where == list.end() or *where != file_nr) {
+         list.insert (where, file_nr);
+      }
+   }
+   file_entry& entry = files[file_nr];
+   entry.file = file;
+   entry.parent = parent;
+   DEBUGF ('x', "added " << file_nr);
+}
+
+void word_index::post (int file_nr, viewvec_itor begin,
+                       viewvec_itor end) {
+   for (viewvec_itor word = begin; word != end; ++word) {
+      posting_list& list = postings[word->str()];
+      auto where = lower_bound (list.begin(), list.end(), file_nr);
+      if (where == list.end() or *where != file_nr) {
+         list.insert (where, file_nr);
+      }
+   }
+}
+
+void word_index::extend (inode_ptr file, inode_ptr parent,
+                         viewvec_itor begin, viewvec_itor end) {
+   int file_nr = file->get_inode_nr();
+   lock_guard<rw_lock> guard (lock);
+   post (file_nr, begin, end);
+   file_entry& entry = files[file_nr];
+   entry.file = file;
+   entry.parent = parent;
+   DEBUGF ('x', "extended " << file_nr);
+}
+
+void word_index::rewrite (inode_ptr file, inode_ptr parent,
+                          viewvec_itor begin, viewvec_itor end) {
+   int file_nr = file->get_inode_nr();
+   lock_guard<rw_lock> guard (lock);
+   post (file_nr, begin, end);
+   files[file_nr] = {file, parent, true};
+   DEBUGF ('x', "rewrote " << file_nr);
+}
+
+void word_index::remove (inode_ptr file) {
+   int file_nr = file->get_inode_nr();
+   {
+      shared_guard guard (lock);
+      if (files.count (file_nr) == 0) return;
+   }
+   viewvec words = distinct_words (file);
+   lock_guard<rw_lock> guard (lock);
+   auto found = files.find (file_nr);
+   if (found == files.end()) return;
+   auto drop = [file_nr] (posting_list& list) {
+      auto where = lower_bound (list.begin(), list.end(), file_nr);
+      if (where != list.end() and *where == file_nr) list.erase (where);
+   };
+   // The words a rewritten file no longer has are not known, so
+   // every list is looked at, before its number is given out again.
+   if (found->second.rewritten) {
+      for (auto list = postings.begin(); list != postings.end();) {
+         drop (list->second);
+         if (list->second.empty()) list = postings.erase (list);
+                              else ++list;
+      }
+   }else {
+      for (strview word: words) {
+         auto list = postings.find (word.str());
+         if (list == postings.end()) continue;
+         drop (list->second);
+         if (list->second.empty()) postings.erase (list);
+      }
+   }
+   files.erase (found);
+   DEBUGF ('x', "removed " << file_nr);
+}
+
+void word_index::move (int file_nr, inode_ptr parent) {
+   lock_guard<rw_lock> guard (lock);
+   auto found = files.find (file_nr);
+   if (found != files.end()) found->second.parent = parent;
+}
+
+void word_index::relink (inode_ptr file, inode_ptr parent) {
+   lock_guard<rw_lock> guard (lock);
+   auto found = files.find (file->get_inode_nr());
+   if (found == files.end()) return;
+   found->second.file = file;
+   found->second.parent = parent;
+}
+
+word_index::posting_list word_index::match_all (const wordvec& terms)
+                                                               const {
+   // Intersect starting with the shortest list, so that each step
+   // is no longer than it.
+   vector<const posting_list*> lists;
+   for (const string& term: terms) {
+      auto found = postings.find (term);
+      if (found == postings.end()) return {};
+      lists.push_back (&found->second);
+   }
+   if (lists.empty()) return {};
+   sort (lists.begin(), lists.end(),
+         [] (const posting_list* one, const posting_list* two) {
+            return one->size() < two->size();
+         });
+   posting_list result = *lists[0];
+   for (size_t index = 1; index < lists.size() and not result.empty();
+        ++index) {
+      posting_list narrowed;
+      set_intersection (result.begin(), result.end(),
+                        lists[index]->begin(), lists[index]->end(),
+                        back_inserter (narrowed));
+      result.swap (narrowed);
+   }
+   return result;
+}
+
+bool word_index::holds (inode_ptr file, const string& pattern) {
+   viewvec words = distinct_words (file);
+   for (const string& alternative: split (pattern, ",")) {
+      bool all = true;
+      for (const string& term: split (alternative, "+")) {
+         all = all and binary_search (words.begin(), words.end(),
+                                      strview (term));
+      }
+      if (all) return true;
+   }
+   return false;
+}
+
+vector<int> word_index::query (const string& pattern) const {
+   shared_guard guard (lock);
+   posting_list result;
+   for (const string& alternative: split (pattern, ",")) {
+      posting_list matched = match_all (split (alternative, "+"));
+      posting_list merged;
+      set_union (result.begin(), result.end(),
+                 matched.begin(), matched.end(),
+                 back_inserter (merged));
+      result.swap (merged);
+   }
+   auto stale_match = [this, &pattern] (int file_nr) {
+      auto found = files.find (file_nr);
+      if (found == files.end() or not found->second.rewritten) {
+         return false;
+      }
+      inode_ptr file = found->second.file.lock();
+      return file != nullptr and not holds (file, pattern);
+   };
+   result.erase (remove_if (result.begin(), result.end(), stale_match),
+                 result.end());
+   DEBUGF ('x', pattern << ": " << result.size() << " files");
+   return result;
+}
+
+void word_index::locate (int file_nr, inode_ptr& file,
+                         inode_ptr& parent) const {
+   shared_guard guard (lock);
+   auto found = files.find (file_nr);
+   if (found == files.end()) {
+      file = parent = nullptr;
+      return;
+   }
+   file = found->second.file.lock();
+   parent = found->second.parent.lock();
+}
+
+void word_index::invalidate() {
+   lock_guard<rw_lock> guard (lock);
+   postings.clear();
+   files.clear();
+   stale = true;
+}
+
+bool word_index::is_stale() const {
+   shared_guard guard (lock);
+   return stale;
+}
+
+void word_index::mark_current() {
+   lock_guard<rw_lock> guard (lock);
+   stale = false;
+}
+
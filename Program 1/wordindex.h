@@ -0,0 +1,99 @@
+// $Id: wordindex.h,v 1.1 2015-01-30 10:17:44-08 - - $
+
+#ifndef __WORDINDEX_H__
+#define __WORDINDEX_H__
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+#include "rwlock.h"
+#include "util.h"
+
+class inode;
+using inode_ptr = shared_ptr<inode>;
+
+//
+// class word_index -
+//    An inverted index from each word in the text files of the
+//    current tree to the files holding it, so that grep need not
+//    read every file.  Each word has a posting list of the inode
+//    numbers of those files, kept sorted, and each file indexed
+//    remembers the directory it is in, for printing its path.
+//    After a load or a restore the index no longer matches the
+//    tree, and is marked stale until it is rebuilt from scratch.
+//    Any number of readers may query at once, while additions and
+//    removals take the index exclusively.
+// add -
+//    Indexes the words of a file just linked into parent.
+// extend -
+//    Indexes words appended to a file in parent, which may be a
+//    copy of the one indexed, without reading its other words.
+// rewrite -
+//    As extend, for words written over others.  The words written
+//    over may still be posted for the file, so it is marked, and a
+//    query checks a marked file's words before returning it.
+// remove -
+//    Drops a file, if it is indexed.  Its words are read back from
+//    it rather than kept here.
+// move -
+//    Records that a file is now in another directory, as when its
+//    directory is copied from a snapshot.
+// relink -
+//    Points an indexed file's entry at a copy of it with the same
+//    number, as when a file a snapshot shares is copied to be
+//    changed.
+// query -
+//    Returns, in inode number order, the files matching a query:
+//    terms joined by "+" must all be present, and alternatives
+//    separated by "," are or'ed, so "a+b,c" matches files with
+//    both a and b, or with c.  A marked file is only returned if
+//    its own words match.
+// locate -
+//    The file and its directory, for an inode number returned by
+//    query.  Either may be nullptr if it has gone away since.
+// invalidate -
+//    Empties the index and marks it stale.
+// is_stale -
+//    Whether the index has to be rebuilt before it is queried.
+// mark_current -
+//    Called once every file has been added back after invalidate.
+//
+
+class word_index {
+   private:
+      using posting_list = vector<int>;
+      struct file_entry {
+         weak_ptr<inode> file;
+         weak_ptr<inode> parent;
+         bool rewritten;
+      };
+      mutable rw_lock lock;
+      unordered_map<string,posting_list> postings;
+      unordered_map<int,file_entry> files;
+      bool stale {false};
+      static viewvec distinct_words (inode_ptr file);
+      posting_list match_all (const wordvec& terms) const;
+      void post (int file_nr, viewvec_itor begin, viewvec_itor end);
+      static bool holds (inode_ptr file, const string& pattern);
+   public:
+      void add (inode_ptr file, inode_ptr parent);
+      void extend (inode_ptr file, inode_ptr parent,
+                   viewvec_itor begin, viewvec_itor end);
+      void rewrite (inode_ptr file, inode_ptr parent,
+                    viewvec_itor begin, viewvec_itor end);
+      void remove (inode_ptr file);
+      void move (int file_nr, inode_ptr parent);
+      void relink (inode_ptr file, inode_ptr parent);
+      vector<int> query (const string& pattern) const;
+      void locate (int file_nr, inode_ptr& file,
+                   inode_ptr& parent) const;
+      void invalidate();
+      bool is_stale() const;
+      void mark_current();
+};
+
+#endif
+
@@ -0,0 +1,153 @@
+// $Id: workpool.cpp,v 1.1 2015-01-21 10:12:54-08 - - $
+
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+
+using namespace std;
+
+#include "debug.h"
+#include "workpool.h"
+
+vector<unique_ptr<work_pool::worker>> work_pool::workers;
+vector<thread> work_pool::threads;
+atomic<size_t> work_pool::pending {0};
+atomic<size_t> work_pool::queued {0};
+exception_ptr work_pool::failure;
+atomic<bool> work_pool::stopping {false};
+mutex work_pool::idle_lock;
+mutex work_pool::run_lock;
+condition_variable work_pool::idle;
+thread_local size_t work_pool::self {0};
+
+void work_pool::start (size_t count) {
+   if (not workers.empty()) return;
+   if (count < 1) count = 1;
+   for (size_t index = 0; index < count; ++index) {
+      workers.push_back (unique_ptr<worker> (new worker()));
+   }
+   for (size_t index = 1; index < count; ++index) {
+      threads.push_back (thread (serve, index));
+   }
+   if (count > 1) atexit (stop);
+   DEBUGF ('w', count << " threads");
+}
+
+size_t work_pool::size() {
+   return workers.empty() ? 1 : workers.size();
+}
+
+//
+// take -
+//    Pops from the back of our own deque, or failing that steals
+//    from the front of the others, starting with our neighbor.
+// execute -
+//    Runs a task, unless one has already failed, keeping the first
+//    exception for run to throw.
+//
+
+bool work_pool::take (size_t index, work_task& task) {
+   size_t count = workers.size();
+   for (size_t step = 0; step < count; ++step) {
+      worker& victim = *workers[(index + step) % count];
+      lock_guard<mutex> guard (victim.lock);
+      if (victim.tasks.empty()) continue;
+      if (step == 0) {
+         task = move (victim.tasks.back());
+         victim.tasks.pop_back();
+      }else {
+         task = move (victim.tasks.front());
+         victim.tasks.pop_front();
+      }
+      --queued;
+      return true;
+   }
+   return false;
+}
+
+void work_pool::execute (work_task& task) {
+   bool failed;
+   {
+      lock_guard<mutex> guard (idle_lock);
+      failed = failure != nullptr;
+   }
+   if (not failed) {
+      try {
+         task();
+      }catch (...) {
+         lock_guard<mutex> guard (idle_lock);
+         if (failure == nullptr) failure = current_exception();
+      }
+   }
+   bool drained;
+   {
+      lock_guard<mutex> guard (idle_lock);
+      drained = --pending == 0;
+   }
+   if (drained) idle.notify_all();
+}
+
+void work_pool::serve (size_t index) {
+   self = index;
+   for (;;) {
+      work_task task;
+      if (take (index, task)) {
+         execute (task);
+         continue;
+      }
+      unique_lock<mutex> guard (idle_lock);
+      idle.wait (guard, []() { return stopping or queued > 0; });
+      if (stopping) break;
+   }
+}
+
+void work_pool::stop() {
+   {
+      lock_guard<mutex> guard (idle_lock);
+      stopping = true;
+   }
+   idle.notify_all();
+   for (thread& worker: threads) worker.join();
+   threads.clear();
+}
+
+void work_pool::run (const work_task& task) {
+   lock_guard<mutex> run_guard (run_lock);
+   start (1);
+   self = 0;
+   spawn (task);
+   for (;;) {
+      work_task next;
+      if (take (0, next)) {
+         execute (next);
+         continue;
+      }
+      unique_lock<mutex> guard (idle_lock);
+      idle.wait (guard, []() { return pending == 0 or queued > 0; });
+      if (pending == 0) break;
+   }
+   exception_ptr failed;
+   {
+      lock_guard<mutex> guard (idle_lock);
+      failed = failure;
+      failure = nullptr;
+   }
+   if (failed != nullptr) rethrow_exception (failed);
+}
+
+void work_pool::spawn (const work_task& task) {
+   // Counted before it is pushed, so that take never counts it off
+   // first.
+   {
+      lock_guard<mutex> guard (idle_lock);
+      ++pending;
+      ++queued;
+   }
+   {
+      worker& mine = *workers[self];
+      lock_guard<mutex> guard (mine.lock);
+      mine.tasks.push_back (task);
+   }
+   idle.notify_one();
+}
+
@@ -0,0 +1,72 @@
+// $Id: workpool.h,v 1.1 2015-01-21 10:12:54-08 - - $
+
+#ifndef __WORKPOOL_H__
+#define __WORKPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+//
+// work_pool -
+//    A static class holding a pool of worker threads for the
+//    traversals that can be split up by subtree.  Each worker has
+//    its own deque of tasks:  it pushes and pops new work at the
+//    back, and when it runs dry it steals from the front of some
+//    other worker's deque, which is where the biggest subtrees are.
+//    Only lsr uses it.  du answers from cached totals, and rmr
+//    spends its time in indexes that take one writer at a time.
+// start -
+//    Starts the given number of threads, counting the caller.  With
+//    one thread (the default), run just calls the task.
+// size -
+//    The number of threads, counting the caller.
+// run -
+//    Runs a task and everything it spawns, with the calling thread
+//    taking part, and returns when all of it has finished.  The
+//    pool runs one task tree at a time:  a second caller waits for
+//    the first to finish.  If a task throws, the tasks not yet
+//    started are dropped, and run throws the first exception once
+//    the others have finished.  Threads with nothing to do sleep.
+// spawn -
+//    Called from inside a task to queue another one.
+//
+
+using work_task = function<void()>;
+
+class work_pool {
+   private:
+      struct worker {
+         mutex lock;
+         deque<work_task> tasks;
+      };
+      static vector<unique_ptr<worker>> workers;
+      static vector<thread> threads;
+      static atomic<size_t> pending;
+      static atomic<size_t> queued;
+      static exception_ptr failure;
+      static atomic<bool> stopping;
+      static mutex idle_lock;
+      static mutex run_lock;
+      static condition_variable idle;
+      static thread_local size_t self;
+      static bool take (size_t index, work_task& task);
+      static void execute (work_task& task);
+      static void serve (size_t index);
+      static void stop();
+   public:
+      static void start (size_t count);
+      static size_t size();
+      static void run (const work_task& task);
+      static void spawn (const work_task& task);
+};
+
+#endif
+